@@ -0,0 +1,809 @@
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/if_tun.h>
+#include <linux/filter.h>
+#include <limits.h>
+
+#include <new>
+#include <algorithm>
+
+#include "filter.h"
+#include "queue.h"
+#include "reorder.h"
+#include "transmit.h"
+#include "vnet.h"
+#include "direction.h"
+#include "link.h"
+#include "mirror.h"
+#include "bridge.h"
+#include "steal.h"
+#include "uring.h"
+#include "shm.h"
+#include "gso.h"
+
+
+void setup_iface(socket_t sock, int iface){
+	// Bind socket to interface
+	struct sockaddr_ll sll;
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = iface;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	bind(sock, (struct sockaddr *)&sll, sizeof(sll));
+	// Set promiscuous mode
+	struct packet_mreq mr;
+	memset(&mr, 0, sizeof (mr));
+	mr.mr_ifindex = iface;
+	mr.mr_type = PACKET_MR_PROMISC;
+	setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr));
+	// Hardware VLAN stripping leaves the tag out of the frame
+	int aux = 1;
+	setsockopt(sock, SOL_PACKET, PACKET_AUXDATA, &aux, sizeof(aux));
+}
+
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING 23
+#endif
+
+
+// Put back any VLAN tag the kernel took out of a frame, as told by the
+// auxdata 'msg' was read with
+int restore_vlan(char *data, int len, msghdr &msg){
+	if (len < 2 * ETH_ALEN) return len;
+	for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+		if (cmsg->cmsg_level != SOL_PACKET || cmsg->cmsg_type != PACKET_AUXDATA){
+			continue;
+		}
+		tpacket_auxdata aux;
+		memcpy(&aux, CMSG_DATA(cmsg), sizeof(aux));
+		if (!(aux.tp_status & TP_STATUS_VLAN_VALID)) continue;
+		uint16_t tag[2] = {
+			htons((aux.tp_status & TP_STATUS_VLAN_TPID_VALID)
+				  ? aux.tp_vlan_tpid : ETH_P_8021Q),
+			htons(aux.tp_vlan_tci)};
+		memmove(&data[2 * ETH_ALEN + VLAN_TAG_LEN], &data[2 * ETH_ALEN],
+				len - 2 * ETH_ALEN);
+		memcpy(&data[2 * ETH_ALEN], tag, VLAN_TAG_LEN);
+		len += VLAN_TAG_LEN;
+	}
+	return len;
+}
+
+
+// Say, the first time, that a frame of 'len' bytes had to be cut to 'room'
+void warn_cut(int room, int len){
+	static bool warned = false;
+	if (!__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED)){
+		fprintf(stderr, "Warning: Frames longer than the MTU cut to %i bytes "
+				"(first was %i)\n", room, len);
+	}
+}
+
+
+/* Read a frame into 'packet', after its virtio-net header if 'vnet'.  With
+ * 'snap_len', only that much of it is copied, its length still being the
+ * whole frame's.
+ */
+int read_frame(socket_t sock, packet_t *packet, bool vnet, int snap_len){
+	int room = packet->size - VLAN_TAG_LEN;
+	int copy = snap_len ? std::min(snap_len, room) : room;
+	iovec iov[2] = {{&packet->vnet, sizeof(vnet_hdr_t)},
+					{packet->data, (size_t)copy}};
+	char control[CMSG_SPACE(sizeof(tpacket_auxdata))];
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = vnet ? iov : &iov[1];
+	msg.msg_iovlen = vnet ? 2 : 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	// The length of the whole frame, however much of it was copied
+	int len = recvmsg(sock, &msg, MSG_TRUNC);
+	if (len < 0) return len;
+	if (vnet) len = std::max(len - (int)sizeof(vnet_hdr_t), 0);
+	if (len > room){
+		warn_cut(room, len);
+		len = room;
+	}
+	packet->snapped = len > copy;
+	int restored = restore_vlan(packet->data, len, msg);
+	packet->len = restored;
+	if (vnet) gso_received(packet, restored - len);
+	return restored;
+}
+
+
+// Read a frame and its virtio-net header from a TAP device
+int read_tap(socket_t fd, packet_t *packet){
+	iovec iov[2] = {{&packet->vnet, sizeof(vnet_hdr_t)},
+					{packet->data, (size_t)packet->size}};
+	int len = readv(fd, iov, 2);
+	if (len < 0) return len;
+	packet->len = std::max(len - (int)sizeof(vnet_hdr_t), 0);
+	gso_received(packet, 0);
+	return packet->len;
+}
+
+
+static void check_name(const char *iface){
+	if (strlen(iface) > (IFNAMSIZ - 1)){
+		fprintf(stderr, "Error: Interface name '%s' too long\n", iface);
+		abort();
+	}
+}
+
+
+mac_t get_mac(socket_t sock, const char* iface){
+	ifreq ifr;
+	strncpy((char *) ifr.ifr_name, iface, IFNAMSIZ);
+
+	if (ioctl(sock, SIOCGIFHWADDR, &ifr) != 0){
+		printf("Error getting H/W address of iface: %s\n", strerror(errno));
+		abort();
+	}
+	mac_t result;
+	memcpy(result.address, ifr.ifr_hwaddr.sa_data, 6);
+	return result;
+}
+
+
+/* Have the kernel turn away frames to or from 'mac', the interface's own,
+ * and drop 'drop' of the rest, scaled as a profile's, before they're ever
+ * read.
+ */
+static void attach_filter(socket_t sock, const mac_t &mac, unsigned long drop,
+						  const char *iface){
+	const uint8_t *m = (const uint8_t *)mac.address;
+	uint32_t high = (m[0] << 24) | (m[1] << 16) | (m[2] << 8) | m[3];
+	uint32_t low = (m[4] << 8) | m[5];
+	// Frames jump to the last instruction to be turned away
+	int reject = drop ? 11 : 9;
+	sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, high, 0, 2),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, low, (uint8_t)(reject - 4), 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, ETH_ALEN),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, high, 0, 2),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, ETH_ALEN + 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, low, (uint8_t)(reject - 8), 0),
+		// Kept when a random 32 bits come out at or above the share dropped
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_RANDOM)),
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, (uint32_t)(drop >> 32), 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	sock_fprog program;
+	program.len = reject + 1;
+	program.filter = code;
+	if (!drop){
+		// Skip the draw
+		code[8] = code[10];
+		code[9] = code[11];
+	}
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &program, 
+				   sizeof(program)) < 0){
+		fprintf(stderr, "Error: Can't filter %s: %s\n", iface, strerror(errno));
+		abort();
+	}
+}
+
+
+/* With 'fanout', the socket joins the others on the interface in sharing
+ * out its frames by flow, so each copy of a bridge gets a share.  With
+ * 'vnet', frames come and go with a virtio-net header, GSO frames whole.
+ */
+int get_raw_iface(const char *iface, bool fanout, bool vnet){
+	struct ifreq ifr;
+	check_name(iface);
+	socket_t sock = socket(PF_PACKET, SOCK_RAW, ETH_P_ALL);
+	// Look up the interface id for eth1
+	strncpy((char *) ifr.ifr_name, iface, IFNAMSIZ);
+	ioctl(sock, SIOCGIFINDEX, &ifr);
+	// Before it's bound, so nothing from this host slips through
+	attach_filter(sock, get_mac(sock, iface), 0, iface);
+	setup_iface(sock, ifr.ifr_ifindex);
+	int group = (ifr.ifr_ifindex & 0xffff) | (PACKET_FANOUT_HASH << 16);
+	if (fanout && setsockopt(sock, SOL_PACKET, PACKET_FANOUT, &group, sizeof(group)) < 0){
+		fprintf(stderr, "Error: Can't share out %s: %s\n", iface, strerror(errno));
+		abort();
+	}
+	int on = 1;
+	if (vnet && setsockopt(sock, SOL_PACKET, PACKET_VNET_HDR, &on, sizeof(on)) < 0){
+		fprintf(stderr, "Error: No virtio-net headers on %s: %s\n", iface, 
+				strerror(errno));
+		abort();
+	}
+	return sock;
+};
+
+
+/* Take a queue of TAP device 'iface', creating it if need be, and bring it
+ * up.  Frames come and go with a virtio-net header, left empty unless
+ * 'offload' lets the device hand over GSO frames and unfinished checksums.
+ */
+int get_tap(const char *iface, bool multi_queue, bool offload){
+	check_name(iface);
+	int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+	if (fd < 0){
+		fprintf(stderr, "Error: Can't open /dev/net/tun: %s\n", strerror(errno));
+		abort();
+	}
+	ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, iface, IFNAMSIZ);
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+	if (multi_queue) ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	int header = sizeof(vnet_hdr_t);
+	if (ioctl(fd, TUNSETIFF, &ifr) < 0 || ioctl(fd, TUNSETVNETHDRSZ, &header) < 0){
+		fprintf(stderr, "Error: Can't attach to TAP device %s: %s\n", iface, 
+				strerror(errno));
+		abort();
+	}
+	unsigned offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+	if (offload && ioctl(fd, TUNSETOFFLOAD, offloads) < 0){
+		fprintf(stderr, "Warning: No offloads on TAP device %s: %s\n", iface,
+				strerror(errno));
+	}
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (ioctl(sock, SIOCGIFFLAGS, &ifr) == 0 && !(ifr.ifr_flags & IFF_UP)){
+		ifr.ifr_flags |= IFF_UP;
+		ioctl(sock, SIOCSIFFLAGS, &ifr);
+	}
+	close(sock);
+	return fd;
+}
+
+
+/* How big a buffer frames read on 'iface' need: the MTU and the link
+ * header, with a VLAN tag in the frame and room to put back one the kernel
+ * took out.  Never less than PACKET_SIZE, so most interfaces share a pool.
+ */
+int frame_size(const char *iface){
+	ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	int size = PACKET_SIZE;
+	if (ioctl(sock, SIOCGIFMTU, &ifr) == 0){
+		size = std::max(size, ifr.ifr_mtu + ETH_HLEN + 2 * VLAN_TAG_LEN);
+	}
+	close(sock);
+	return size;
+}
+
+
+int cmp_times (const timespec &a, const timespec &b) {
+	if (a.tv_sec == b.tv_sec){
+		return (a.tv_nsec == b.tv_nsec) ? 0 : ((a.tv_nsec > b.tv_nsec) ? 1 : -1);
+	}
+	return (a.tv_sec == b.tv_sec) ? 0 : ((a.tv_sec > b.tv_sec) ? 1 : -1);
+ }
+
+static const size_t NS_PER_S = 1000000000;
+
+
+// Whether 'd' may send its next frame now
+bool can_send(const direction_t &d, const timespec &this_tick, uint64_t now){
+	return !d.queue.empty() && cmp_times(this_tick, d.queue_time) > 0
+		&& slot_is_open(d, now);
+}
+
+
+// Pass on frames 'd' has finished holding, and say when it next needs to
+// run again, unless it has frames to send now
+uint64_t direction_ready(direction_t &d, const timespec &this_tick, uint64_t now,
+						 bool &writable){
+	reorder_release(d, now);
+	uint64_t wake = reorder_next_wake(d);
+	if (d.queue.empty()) return wake;
+	if (can_send(d, this_tick, now)){
+		writable = true;
+		return wake;
+	}
+	return earliest(wake, std::max(timespec_ns(d.queue_time), d.slot.opens));
+}
+
+
+// Returns false if the socket wouldn't take any more
+bool send_queued(port_t &port, direction_t &d, mirror_t *mirror, 
+				 const timespec &this_tick, uint64_t now){
+	const direction_config_t &config = *d.config;
+	// Paced frames go one at a time, unless a slot sends them
+	// as a burst; pacing then covers the whole burst
+	int max_packets = config.bandwidth ? 1 : TX_BATCH;
+	long max_bytes = LONG_MAX;
+	if (config.slot_max){
+		max_packets = config.slot_packets ? config.slot_packets : INT_MAX;
+		if (config.slot_bytes) max_bytes = config.slot_bytes;
+	}
+	long len;
+	int sent;
+	if (port.shm){
+		sent = shm_transmit(*port.shm, d, max_packets, max_bytes, mirror, len);
+	} else if (port.tap){
+		sent = tap_transmit(port.sock, d.queue, max_packets, max_bytes, mirror, len);
+	} else if (port.uring){
+		sent = uring_transmit(*port.uring, port.sock, port.in_flight, d, 
+							  max_packets, max_bytes, mirror, len);
+	} else {
+		sent = transmit(port.sock, port.gso, d.queue, max_packets, max_bytes, 
+						mirror, len);
+	}
+	if (!sent) return false;
+	d.stats.sent += sent;
+	d.stats.sent_bytes += len;
+	if (config.slot_max) slot_close(d, now);
+	if (config.bandwidth){
+		timespec &target_sleep = d.queue_time;
+		size_t ns_to_sleep = config.bandwidth * len;
+		target_sleep = this_tick;
+		target_sleep.tv_sec += ns_to_sleep / NS_PER_S;
+		target_sleep.tv_nsec += ns_to_sleep % NS_PER_S;
+	}
+	return true;
+}
+
+
+// Queue a frame filter() has dealt with and impair() changed, taking over
+// the reference
+void deliver(direction_t &d, packet_t *packet, int cls, flow_t *flow, 
+			 mirror_t *mirror, bool kept, uint64_t now){
+	const direction_config_t &config = *d.config;
+	if (kept){
+		kept = reorder_enqueue(d, packet, cls, flow, 0, now);
+		// Copies share the original's buffer
+		int copies = duplicate_count(d);
+		for (int c=1; c<=copies; ++c){
+			reorder_enqueue(d, packet, cls, flow, config.duplicate_delay * c, now);
+		}
+	} else {
+		++d.stats.dropped;
+	}
+	if (!kept && mirror) mirror_dropped(*mirror, packet);
+	packet_unref(packet);
+}
+
+
+/* Impair and deliver a frame filter() has decided on, taking over the
+ * reference.  With a work queue, the changes to its bytes may be made by
+ * another worker, and it's delivered once they're done.
+ */
+static void dispatch(direction_t &d, packet_t *packet, int cls, flow_t *flow, 
+					 mirror_t *mirror, bool kept, const impair_t &work,
+					 steal_queue_t *queue, uint64_t now){
+	if (queue){
+		steal_item_t item = {&d, packet, flow, mirror, cls, kept, work, 0};
+		steal_publish(*queue, item, now);
+		return;
+	}
+	if (kept) impair(packet, work);
+	deliver(d, packet, cls, flow, mirror, kept, now);
+}
+
+
+/* A GSO frame goes on whole if its segments are all kept, or all dropped,
+ * and counts as one frame.  Otherwise it's cut up, and each segment goes
+ * its own way and counts as a frame of its own.
+ */
+static void forward_segments(direction_t &d, packet_t *packet, int segments,
+							 int cls, flow_t *flow, mirror_t *mirror,
+							 steal_queue_t *queue, uint64_t now){
+	const profile_t &profile = d.config->profiles[cls];
+	impair_t work;
+	work.corrupt_seed = 0;
+	work.truncate_len = 0;
+	bool split;
+	uint64_t dropped = filter_segments(d, profile, flow, packet, segments, split);
+	if (!split){
+		dispatch(d, packet, cls, flow, mirror, !dropped, work, queue, now);
+		return;
+	}
+	d.stats.received += segments - 1;
+	for (int s=0; s<segments; ++s){
+		packet_t *segment = gso_segment(packet, s);
+		bool kept = !(dropped >> s & 1);
+		if (!dropped) kept = filter(d, profile, flow, segment, work);
+		dispatch(d, segment, cls, flow, mirror, kept, work, queue, now);
+	}
+	packet_unref(packet);
+}
+
+
+// Impair a frame on its way out through 'd', taking over the reference
+void forward(direction_t &d, packet_t *packet, mirror_t *mirror, 
+			 steal_queue_t *queue, uint64_t now){
+	direction_config_t &config = *d.config;
+	++d.stats.received;
+	class_key_t key;
+	int cls = 0;
+	flow_t *flow = NULL;
+	if (config.classifier.rules || config.flow_table_size){
+		frame_key(packet->data, packet->len, key);
+		cls = classify(config.classifier, key);
+		if (config.flow_table_size) flow = flow_lookup(d.flows, key);
+	}
+	int segments = gso_segments(packet);
+	if (segments > 1){
+		forward_segments(d, packet, segments, cls, flow, mirror, queue, now);
+		return;
+	}
+	impair_t work;
+	bool kept = filter(d, config.profiles[cls], flow, packet, work);
+	dispatch(d, packet, cls, flow, mirror, kept, work, queue, now);
+}
+
+
+/* The ports a frame read on 'in' leaves through.  Two ports behave as a
+ * hub, sending everything across; with more, known unicast goes to the one
+ * port its destination was learnt on and everything else is flooded.
+ */
+int egress_ports(link_map_t &links, int n_ports, int in, const char *data,
+				 int vlan, uint64_t now, int *out){
+	int to = -1;
+	if (n_ports > 2){
+		fdb_learn(*links.fdb, vlan, &data[ETH_ALEN], in, now);
+		if (!(data[0] & 1)) to = fdb_lookup(*links.fdb, vlan, data, now);
+	}
+	if (to == in) return 0;
+	if (to >= 0){
+		out[0] = to;
+		return 1;
+	}
+	int count = 0;
+	for (int port=0; port<n_ports; ++port){
+		if (port != in) out[count++] = port;
+	}
+	return count;
+}
+
+
+/* Open a bridge between 'interfaces', named as they are or "tap:NAME" for
+ * TAP devices.  One of several 'queues' gets a queue of each TAP device and
+ * a share of each interface's frames.  With 'gso', GSO frames are read
+ * whole and sent on as they are.
+ */
+void bridge_open(bridge_t &b, const std::string &name,
+				 const std::vector<std::string> &interfaces, unsigned long seed,
+				 int queues, bool gso){
+	b.name = name;
+	b.n_ports = interfaces.size();
+	b.links.seed = seed;
+	mirror_init(b.mirror);
+	b.mirror.vnet = gso;
+	if (b.n_ports > 2){
+		void *memory;
+		if (posix_memalign(&memory, 64, sizeof(fdb_t))){
+			fprintf(stderr, "Error: Out of memory for bridge '%s'\n", name.c_str());
+			abort();
+		}
+		b.links.fdb = new (memory) fdb_t();
+	}
+	for (int port=0; port<b.n_ports; ++port){
+		const char *iface = interfaces[port].c_str();
+		b.config.ports.push_back(iface);
+		port_t &p = b.ports[port];
+		p.tap = !strncmp(iface, TAP_PREFIX, strlen(TAP_PREFIX));
+		p.shm = NULL;
+		p.gso = gso;
+		p.snap_len = 0;
+		if (!strncmp(iface, SHM_PREFIX, strlen(SHM_PREFIX))){
+			// There's only the one pair of rings
+			if (queues > 1){
+				fprintf(stderr, "Error: Shared memory port %s can't be queued\n",
+						iface);
+				abort();
+			}
+			p.shm = shm_port_open(iface + strlen(SHM_PREFIX));
+			p.sock = p.shm->hub_event;
+			p.gso = false;
+			p.packet_size = PACKET_SIZE;
+			memset(&p.mac, 0, sizeof(p.mac));
+		} else if (p.tap){
+			iface += strlen(TAP_PREFIX);
+			p.sock = get_tap(iface, queues > 1, gso);
+			p.mac = get_mac(p.sock, iface);
+			p.packet_size = frame_size(iface);
+		} else {
+			p.sock = get_raw_iface(iface, queues > 1, gso);
+			p.mac = get_mac(p.sock, iface);
+			p.packet_size = frame_size(iface);
+		}
+		if (gso) p.packet_size = std::max(p.packet_size, PACKET_GSO_SIZE);
+		b.ports[port].writing = false;
+		b.ports[port].reading = true;
+		b.ports[port].uring = NULL;
+		b.ports[port].in_flight = 0;
+	}
+}
+
+
+/* Give the frames read on port 1 of a two port bridge a bridge of their
+ * own, so each direction can run on a thread of its own.  The halves share
+ * the sockets and nothing else: each sends through the port the other reads.
+ */
+bridge_t *bridge_split(bridge_t &b, unsigned long seed){
+	for (int port=0; port<b.n_ports; ++port){
+		// Its peer wakes one thread, for room and for frames alike
+		if (b.ports[port].shm){
+			fprintf(stderr, "Error: Bridge with shared memory port %s can't be "
+					"split\n", b.config.ports[port].c_str());
+			abort();
+		}
+	}
+	bridge_t *half = new bridge_t();
+	half->name = b.name;
+	half->n_ports = b.n_ports;
+	half->config.ports = b.config.ports;
+	half->links.seed = seed;
+	mirror_init(half->mirror);
+	half->mirror.vnet = b.mirror.vnet;
+	half->mirror.qdisc_bypass = b.mirror.qdisc_bypass;
+	for (int port=0; port<b.n_ports; ++port) half->ports[port] = b.ports[port];
+	b.ports[1].reading = false;
+	half->ports[0].reading = false;
+	return half;
+}
+
+
+// Have the kernel poll the devices for frames for up to 'usecs' when they
+// have none, rather than wait for an interrupt
+void bridge_busy_poll(bridge_t &b, int usecs){
+	int prefer = 1;
+	for (int port=0; port<b.n_ports; ++port){
+		socket_t sock = b.ports[port].sock;
+		if (b.ports[port].tap || b.ports[port].shm) continue;
+		if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0
+			|| setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, 
+						  sizeof(prefer)) < 0){
+			fprintf(stderr, "Warning: No busy polling on %s: %s\n", 
+					b.config.ports[port].c_str(), strerror(errno));
+		}
+	}
+}
+
+
+/* Have the packet sockets hand frames straight to the devices, past their
+ * qdiscs, and not read back what leaves through the interfaces: ours, this
+ * host's, or another queue's sends.
+ */
+void bridge_bypass(bridge_t &b, bool qdisc_bypass, bool ignore_outgoing){
+	int on = 1;
+	b.mirror.qdisc_bypass = qdisc_bypass;
+	for (int port=0; port<b.n_ports; ++port){
+		socket_t sock = b.ports[port].sock;
+		const char *iface = b.config.ports[port].c_str();
+		if (b.ports[port].tap || b.ports[port].shm) continue;
+		if (qdisc_bypass 
+			&& setsockopt(sock, SOL_PACKET, PACKET_QDISC_BYPASS, &on, sizeof(on)) < 0){
+			fprintf(stderr, "Warning: %s can't bypass its qdisc: %s\n", iface,
+					strerror(errno));
+		}
+		if (ignore_outgoing && setsockopt(sock, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+										  &on, sizeof(on)) < 0){
+			fprintf(stderr, "Warning: %s still reads its outgoing frames: %s\n",
+					iface, strerror(errno));
+		}
+	}
+}
+
+
+/* Copy no more of each frame read on a port than the most any port it may
+ * leave through keeps of it, when they all truncate.  Dropped frames sent
+ * to the mirror are wanted whole, and GSO frames may be cut up, so they
+ * need all of it.
+ */
+static void set_snap_lens(bridge_t &b){
+	for (int in=0; in<b.n_ports; ++in){
+		port_t &p = b.ports[in];
+		bool truncated = !p.gso && !b.config.mirror_dropped_vlan;
+		unsigned long most = 0;
+		for (link_t *link : b.links.active){
+			for (int port=0; port<b.n_ports && truncated; ++port){
+				if (port == in) continue;
+				for (const profile_t &profile : link->out[port]->config->profiles){
+					if (!profile.truncate_len) truncated = false;
+					most = std::max(most, profile.truncate_len);
+				}
+			}
+		}
+		most = std::max(most, (unsigned long)SNAP_MIN);
+		p.snap_len = (truncated && most < INT_MAX) ? most : 0;
+	}
+}
+
+
+/* Have the kernel drop frames read on a port of a two port bridge, rather
+ * than read them only to drop them, when all of them are dropped alike:
+ * every profile of the direction they leave by, on every link, has the
+ * same loss, nothing per flow, and dropped frames aren't mirrored.  The
+ * profiles then leave the dropping to the kernel.
+ */
+static void set_filters(bridge_t &b){
+	for (int in=0; in<b.n_ports; ++in){
+		port_t &p = b.ports[in];
+		if (p.tap || p.shm || !p.reading) continue;
+		int out = 1 - in;
+		bool alike = b.n_ports == 2 && !p.gso && !b.config.mirror_dropped_vlan
+			&& !b.links.active.empty();
+		unsigned long drop = alike 
+			? b.links.active[0]->out[out]->config->profiles[0].drop 
+			: 0;
+		for (link_t *link : b.links.active){
+			if (!alike) break;
+			for (const profile_t &profile : link->out[out]->config->profiles){
+				alike &= !profile.drop_correlation && !profile.drop_nth
+					&& profile.drop == drop;
+			}
+		}
+		if (!alike) drop = 0;
+		attach_filter(p.sock, p.mac, drop, b.config.ports[in].c_str());
+		if (!drop) continue;
+		for (link_t *link : b.links.active){
+			for (profile_t &profile : link->out[out]->config->profiles){
+				profile.drop = 0;
+			}
+		}
+	}
+}
+
+
+// Called after the bridge's config has been (re)loaded
+void bridge_reset(bridge_t &b, uint64_t now){
+	link_map_reset(b.links, b.config, now);
+	set_snap_lens(b);
+	set_filters(b);
+	if (b.links.fdb) fdb_clear(*b.links.fdb);
+	mirror_open(b.mirror, b.config.mirror, b.config.mirror_dropped_vlan);
+}
+
+
+// Say which ports have frames to send now, and when the bridge next needs
+// to run if nothing else wakes it
+uint64_t bridge_ready(bridge_t &b, const timespec &this_tick, uint64_t now,
+					  bool *writable){
+	uint64_t wake = 0;
+	for (link_t *link : b.links.active){
+		for (int port=0; port<b.n_ports; ++port){
+			wake = earliest(wake, direction_ready(*link->out[port], this_tick,
+												  now, writable[port]));
+		}
+	}
+	return wake;
+}
+
+
+void bridge_send(bridge_t &b, int port, const timespec &this_tick, uint64_t now){
+	mirror_t *mirror = (b.mirror.sock >= 0) ? &b.mirror : NULL;
+	size_t n_links = b.links.active.size();
+	for (size_t l=0; l<n_links; ++l){
+		link_t *link = b.links.active[(b.tx_next + l) % n_links];
+		direction_t &d = *link->out[port];
+		if (!can_send(d, this_tick, now)) continue;
+		if (!send_queued(b.ports[port], d, mirror, this_tick, now)) break;
+	}
+	++b.tx_next;
+}
+
+
+// Returns false if there was nothing to read after all
+static bool receive(bridge_t &b, int port, uint64_t now){
+	port_t &p = b.ports[port];
+	packet_t *packet = packet_alloc(p.packet_size);
+	int len;
+	if (p.shm) len = shm_read(*p.shm, packet->data, packet->size - VLAN_TAG_LEN);
+	else if (p.tap) len = read_tap(p.sock, packet);
+	else len = read_frame(p.sock, packet, p.gso, p.snap_len);
+	// TAP devices and rings don't block, and may have nothing after all
+	if (len < 0 && errno == EAGAIN){
+		packet_unref(packet);
+		return false;
+	}
+	if (len < 0){
+		printf("Read failed: %s from %i\n", strerror(errno), p.sock);
+		abort();
+	}
+	packet->len = len;
+	bridge_input(b, port, packet, now);
+	return true;
+}
+
+
+// Read a frame, or everything a shared memory port's peer woke us for;
+// false if there was nothing after all
+bool bridge_receive(bridge_t &b, int port, uint64_t now){
+	port_t &p = b.ports[port];
+	if (!p.shm) return receive(b, port, now);
+	shm_drain(*p.shm);
+	bool any = false;
+	while (receive(b, port, now)) any = true;
+	return any;
+}
+
+
+// Switch a frame read on 'port', taking over the reference
+void bridge_input(bridge_t &b, int port, packet_t *packet, uint64_t now){
+	char *in_data = packet->data;
+	int len = packet->len;
+	int targets[PORTS_MAX];
+	int vlan = frame_vlan(in_data, len);
+	// Frames to or from this host never get this far: a packet socket's
+	// filter turns them away, a TAP device's own address is the far end's,
+	// and a shared memory port has none
+	int n_targets = egress_ports(b.links, b.n_ports, port, in_data, vlan, now,
+								 targets);
+	link_t *link = b.links.by_vlan[vlan];
+	mirror_t *mirror = (b.mirror.sock >= 0 && b.mirror.dropped_vlan) 
+		? &b.mirror : NULL;
+	for (int t=0; t<n_targets; ++t){
+		direction_t &d = *link->out[targets[t]];
+		// A shared memory port's peer takes plain frames, cut up and
+		// checksummed
+		if (b.ports[targets[t]].shm 
+			&& ((packet->vnet.flags & VNET_NEEDS_CSUM) || packet->vnet.gso_type)){
+			int segments = gso_segments(packet);
+			for (int s=0; s<segments; ++s){
+				forward(d, gso_segment(packet, s), mirror, b.work, now);
+			}
+			if (t + 1 == n_targets) packet_unref(packet);
+			continue;
+		}
+		// The last port takes over the read's reference, so a
+		// frame leaving through just one can be impaired in place
+		packet_t *out = (t + 1 < n_targets) ? packet_ref(packet) : packet;
+		forward(d, out, mirror, b.work, now);
+	}
+	if (!n_targets) packet_unref(packet);
+}
+
+
+/* Read what the shared memory ports' peers have sent, woken or not, and
+ * return whether there was anything.  Their rings fill without a word
+ * unless we said we were sleeping.
+ */
+bool bridge_poll(bridge_t &b, uint64_t now){
+	bool any = false;
+	for (int port=0; port<b.n_ports; ++port){
+		port_t &p = b.ports[port];
+		if (!p.shm || !p.reading) continue;
+		while (receive(b, port, now)) any = true;
+	}
+	return any;
+}
+
+
+// Tell the shared memory ports' peers to wake us; false if one has frames
+bool bridge_idle(bridge_t &b){
+	for (int port=0; port<b.n_ports; ++port){
+		port_t &p = b.ports[port];
+		if (p.shm && p.reading && !shm_idle(*p.shm)) return false;
+	}
+	return true;
+}
+
+
+void bridge_print_stats(const bridge_t &b){
+	// Only ports frames are read for are sent through
+	bool sends[PORTS_MAX] = {false};
+	for (int port=0; port<b.n_ports; ++port){
+		for (int in=0; in<b.n_ports; ++in){
+			if (in != port && b.ports[in].reading) sends[port] = true;
+		}
+	}
+	link_map_print_stats(b.links, b.config, b.name.c_str(), sends);
+	mirror_print_stats(b.mirror, b.name.c_str());
+}
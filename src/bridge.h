@@ -0,0 +1,87 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "filter.h"
+#include "link.h"
+#include "mirror.h"
+
+struct steal_queue_t;
+struct uring_t;
+struct shm_port_t;
+
+typedef int socket_t;
+typedef struct mac_t { char address[6]; } mac_t;
+
+static const int VLAN_TAG_LEN = 4;
+
+// Least copied of a truncated frame: room for the headers classifying and
+// checksum repair look at
+static const int SNAP_MIN = 128;
+
+// Mark an interface name as a TAP device's, or a shared memory port's
+static const char TAP_PREFIX[] = "tap:";
+static const char SHM_PREFIX[] = "shm:";
+
+struct port_t{
+	socket_t sock;
+	mac_t mac;
+	// Whether epoll is waiting for the socket to take more frames
+	bool writing;
+	// False for the port a split bridge's other half reads
+	bool reading;
+	// A TAP device's queue rather than a packet socket
+	bool tap;
+	// Or a shared memory port, with 'sock' the eventfd its peer wakes us with
+	shm_port_t *shm;
+	// The ring frames are sent through, or NULL to send them directly
+	uring_t *uring;
+	// Sends queued on the ring and not yet done
+	int in_flight;
+	// A packet socket reading and writing frames with a virtio-net header,
+	// GSO frames whole
+	bool gso;
+	// Size of the buffers frames are read into, from the interface's MTU
+	int packet_size;
+	// Bytes worth copying of each frame read, or 0 for all of them
+	int snap_len;
+};
+
+/* A hub or switch between a set of interfaces, with its own config, links
+ * and learnt addresses.  Only one worker thread ever runs a bridge.
+ */
+struct bridge_t{
+	std::string name;
+	config_t config;
+	link_map_t links;
+	port_t ports[PORTS_MAX];
+	int n_ports;
+	mirror_t mirror;
+	// The worker's queue, when other workers may impair its frames
+	steal_queue_t *work;
+	// Links take turns at being first to a socket
+	size_t tx_next;
+};
+
+void bridge_open(bridge_t &b, const std::string &name,
+				 const std::vector<std::string> &interfaces, unsigned long seed,
+				 int queues, bool gso);
+bridge_t *bridge_split(bridge_t &b, unsigned long seed);
+void bridge_busy_poll(bridge_t &b, int usecs);
+void bridge_bypass(bridge_t &b, bool qdisc_bypass, bool ignore_outgoing);
+void bridge_reset(bridge_t &b, uint64_t now);
+uint64_t bridge_ready(bridge_t &b, const timespec &this_tick, uint64_t now,
+					  bool *writable);
+void bridge_send(bridge_t &b, int port, const timespec &this_tick, uint64_t now);
+bool bridge_receive(bridge_t &b, int port, uint64_t now);
+bool bridge_poll(bridge_t &b, uint64_t now);
+bool bridge_idle(bridge_t &b);
+void bridge_input(bridge_t &b, int port, packet_t *packet, uint64_t now);
+void bridge_print_stats(const bridge_t &b);
+int restore_vlan(char *data, int len, msghdr &msg);
+void warn_cut(int room, int len);
+void deliver(direction_t &d, packet_t *packet, int cls, flow_t *flow, 
+			 mirror_t *mirror, bool kept, uint64_t now);
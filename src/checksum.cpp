@@ -0,0 +1,294 @@
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "checksum.h"
+
+/* Internet checksum helpers used to keep impaired frames acceptable to the
+ * receiving stack.  All sums are taken over 16-bit words in memory order, so
+ * a folded sum can be stored straight back into the packet.
+ */
+
+static inline uint16_t load16(const char *p){
+	uint16_t v;
+	memcpy(&v, p, 2);
+	return v;
+}
+
+
+static inline void store16(char *p, uint16_t v){
+	memcpy(p, &v, 2);
+}
+
+
+static inline uint16_t swap16(uint16_t v){
+	return (v << 8) | (v >> 8);
+}
+
+
+uint16_t csum_fold(uint32_t sum){
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+
+uint32_t csum_partial(const void *data, size_t len, uint32_t sum){
+	const char *p = (const char *)data;
+	uint64_t total = sum;
+#ifdef __SSE2__
+	// Widen each 16-bit word into a 32-bit lane; the lanes can't overflow
+	// for anything smaller than 512KiB, far beyond a GSO frame.
+	if (len >= 16){
+		__m128i zero = _mm_setzero_si128();
+		__m128i acc = zero;
+		while (len >= 16){
+			__m128i v = _mm_loadu_si128((const __m128i *)p);
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+			p += 16;
+			len -= 16;
+		}
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i *)lanes, acc);
+		total += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+#endif
+	while (len >= 8){
+		uint32_t a, b;
+		memcpy(&a, p, 4);
+		memcpy(&b, p + 4, 4);
+		total += (uint64_t)a + b;
+		p += 8;
+		len -= 8;
+	}
+	while (len >= 2){
+		total += load16(p);
+		p += 2;
+		len -= 2;
+	}
+	if (len){
+		char last[2] = {*p, 0};
+		total += load16(last);
+	}
+	while (total >> 32) total = (total & 0xffffffff) + (total >> 32);
+	return total;
+}
+
+
+bool csum_parse(const char *data, int len, csum_info_t &info){
+	const uint8_t *p = (const uint8_t *)data;
+	if (len < ETH_HLEN) return false;
+	int off = 12;
+	uint16_t ethertype = (p[off] << 8) | p[off + 1];
+	while ((ethertype == ETH_P_8021Q || ethertype == ETH_P_8021AD)
+		   && off + 6 <= len){
+		off += 4;
+		ethertype = (p[off] << 8) | p[off + 1];
+	}
+	off += 2;
+	info.l3 = off;
+	info.l4_csum = -1;
+	info.udp_len = -1;
+	info.l3_dirty = false;
+	info.l4_dirty = false;
+	info.fields_hit = false;
+	bool fragment = false;
+	if (ethertype == ETH_P_IP){
+		if (len < off + 20 || (p[off] >> 4) != 4) return false;
+		int ihl = (p[off] & 0xf) * 4;
+		int total = (p[off + 2] << 8) | p[off + 3];
+		if (ihl < 20 || total < ihl || len < off + ihl) return false;
+		info.version = 4;
+		info.proto = p[off + 9];
+		info.l4 = off + ihl;
+		info.l3_end = (off + total < len) ? off + total : len;
+		info.ip_length = load16(&data[off + 2]);
+		// The L4 checksum covers the whole datagram, not this fragment
+		fragment = ((p[off + 6] & 0x3f) | p[off + 7]) != 0;
+	} else if (ethertype == ETH_P_IPV6){
+		if (len < off + 40 || (p[off] >> 4) != 6) return false;
+		int payload = (p[off + 4] << 8) | p[off + 5];
+		info.version = 6;
+		info.proto = p[off + 6];
+		info.l4 = off + 40;
+		info.l3_end = (info.l4 + payload < len) ? info.l4 + payload : len;
+		info.ip_length = load16(&data[off + 4]);
+	} else {
+		return false;
+	}
+	if (fragment) return true;
+	if (info.proto == IPPROTO_TCP && info.l4 + 20 <= info.l3_end){
+		info.l4_csum = info.l4 + 16;
+	} else if (info.proto == IPPROTO_UDP && info.l4 + 8 <= info.l3_end){
+		info.udp_len = info.l4 + 4;
+		info.udp_length = load16(&data[info.udp_len]);
+		// A zero UDP checksum means the sender didn't compute one
+		if (info.version == 6 || p[info.l4 + 6] || p[info.l4 + 7]){
+			info.l4_csum = info.l4 + 6;
+		}
+	}
+	return true;
+}
+
+
+// RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m')
+static void csum_replace(char *data, const csum_info_t &info, int field,
+						 uint16_t old_word, uint16_t new_word){
+	uint16_t check = load16(&data[field]);
+	uint32_t sum = (uint16_t)~check + (uint16_t)~old_word + new_word;
+	check = ~csum_fold(sum);
+	if (check == 0 && field == info.l4_csum && info.proto == IPPROTO_UDP){
+		check = 0xffff;
+	}
+	store16(&data[field], check);
+}
+
+
+// Whether byte 'index' is in a length or protocol field, which the
+// receiver checks against the frame rather than a checksum
+static bool in_fields(const csum_info_t &info, int index){
+	int at = index - info.l3;
+	if (info.version == 4 && (at == 2 || at == 3 || at == 9)) return true;
+	if (info.version == 6 && at >= 4 && at <= 6) return true;
+	return info.udp_len >= 0 && (index == info.udp_len || index == info.udp_len + 1);
+}
+
+
+void csum_update_byte(char *data, csum_info_t &info, int index, char old){
+	if (index < info.l3 || index >= info.l3_end) return;
+	if (in_fields(info, index)) info.fields_hit = true;
+	int word = index - ((index - info.l3) & 1);
+	// A trailing odd byte is summed as if padded with zero
+	char after[2] = {data[word], (word + 1 < info.l3_end) ? data[word + 1] : (char)0};
+	char before[2] = {after[0], after[1]};
+	before[index - word] = old;
+	uint16_t old_word = load16(before);
+	uint16_t new_word = load16(after);
+	if (index < info.l4){
+		if (info.version == 4){
+			int check = info.l3 + 10;
+			if (index == check || index == check + 1) info.l3_dirty = true;
+			else if (!info.l3_dirty) csum_replace(data, info, check, old_word, new_word);
+		}
+		// Source and destination addresses are part of the pseudo header,
+		// IPv4 options aren't
+		int addr = info.l3 + ((info.version == 4) ? 12 : 8);
+		if (index < addr || info.l4_csum < 0 || info.l4_dirty) return;
+		if (info.version == 4 && index >= info.l3 + 20) return;
+	} else if (info.l4_csum < 0){
+		return;
+	} else if (index == info.l4_csum || index == info.l4_csum + 1){
+		info.l4_dirty = true;
+		return;
+	}
+	if (!info.l4_dirty) csum_replace(data, info, info.l4_csum, old_word, new_word);
+}
+
+
+void csum_truncate(char *data, csum_info_t &info, int new_len){
+	if (new_len >= info.l3_end) return;
+	// Nothing sensible can be said about a datagram missing its IP header
+	if (new_len < info.l4){
+		info.l4_csum = -1;
+		info.udp_len = -1;
+		info.l3_dirty = false;
+		info.l4_dirty = false;
+		info.fields_hit = false;
+		info.l3_end = new_len;
+		return;
+	}
+	if (info.version == 4){
+		uint16_t old_total = load16(&data[info.l3 + 2]);
+		uint16_t new_total = htons(new_len - info.l3);
+		store16(&data[info.l3 + 2], new_total);
+		info.ip_length = new_total;
+		if (!info.l3_dirty){
+			csum_replace(data, info, info.l3 + 10, old_total, new_total);
+		}
+	} else {
+		info.ip_length = htons(new_len - info.l4);
+		store16(&data[info.l3 + 4], info.ip_length);
+	}
+	int old_end = info.l3_end;
+	info.l3_end = new_len;
+	// Only a complete UDP/TCP header can carry a meaningful checksum
+	if (new_len < info.l4 + ((info.proto == IPPROTO_UDP) ? 8 : 20)){
+		info.l4_csum = -1;
+		info.udp_len = -1;
+		info.l4_dirty = false;
+		return;
+	}
+	uint16_t new_l4_len = htons(new_len - info.l4);
+	if (info.udp_len >= 0){
+		uint16_t old_field = load16(&data[info.udp_len]);
+		store16(&data[info.udp_len], new_l4_len);
+		info.udp_length = new_l4_len;
+		if (info.l4_csum >= 0 && !info.l4_dirty){
+			csum_replace(data, info, info.l4_csum, old_field, new_l4_len);
+		}
+	}
+	if (info.l4_csum < 0 || info.l4_dirty) return;
+	// Pseudo header length, then take the removed tail back out of the sum,
+	// unless it's cheaper to sum the bytes that remain
+	int removed = old_end - new_len;
+	if (removed > new_len - info.l4){
+		info.l4_dirty = true;
+		return;
+	}
+	csum_replace(data, info, info.l4_csum, htons(old_end - info.l4), new_l4_len);
+	uint16_t tail = csum_fold(csum_partial(&data[new_len], removed, 0));
+	if ((new_len - info.l4) & 1) tail = swap16(tail);
+	csum_replace(data, info, info.l4_csum, tail, 0);
+}
+
+
+/* Put back the lengths and protocol corruption hit: the receiver would
+ * drop the frame over them whatever the checksums said, and they're part
+ * of the L4 checksum's pseudo header besides.
+ */
+static void restore_fields(char *data, csum_info_t &info){
+	int length = info.l3 + ((info.version == 4) ? 2 : 4);
+	int proto = info.l3 + ((info.version == 4) ? 9 : 6);
+	if (load16(&data[length]) != info.ip_length 
+		|| (uint8_t)data[proto] != info.proto){
+		store16(&data[length], info.ip_length);
+		data[proto] = info.proto;
+		info.l3_dirty = true;
+	}
+	if (info.udp_len < 0) return;
+	uint16_t old_field = load16(&data[info.udp_len]);
+	if (old_field == info.udp_length) return;
+	store16(&data[info.udp_len], info.udp_length);
+	if (info.l4_csum >= 0 && !info.l4_dirty){
+		csum_replace(data, info, info.l4_csum, old_field, info.udp_length);
+	}
+}
+
+
+void csum_finish(char *data, csum_info_t &info){
+	if (info.fields_hit) restore_fields(data, info);
+	if (info.l3_dirty && info.version == 4){
+		int check = info.l3 + 10;
+		store16(&data[check], 0);
+		store16(&data[check], ~csum_fold(csum_partial(&data[info.l3],
+												  info.l4 - info.l3, 0)));
+	}
+	if (info.l4_dirty && info.l4_csum >= 0){
+		int l4_len = info.l3_end - info.l4;
+		uint32_t sum = (info.version == 4)
+			? csum_partial(&data[info.l3 + 12], 8, 0)
+			: csum_partial(&data[info.l3 + 8], 32, 0);
+		sum = csum_fold(sum) + htons(info.proto) + htons(l4_len);
+		store16(&data[info.l4_csum], 0);
+		uint16_t check = ~csum_fold(csum_partial(&data[info.l4], l4_len, sum));
+		if (check == 0 && info.proto == IPPROTO_UDP) check = 0xffff;
+		store16(&data[info.l4_csum], check);
+	}
+	info.l3_dirty = false;
+	info.l4_dirty = false;
+}
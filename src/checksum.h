@@ -0,0 +1,27 @@
+#include <stdint.h>
+#include <stddef.h>
+
+// Where the checksummed headers of a frame live, found before the frame
+// is impaired so later corruption of the headers can't mislead the repair.
+struct csum_info_t{
+	int l3;            // Offset of the IPv4/IPv6 header
+	int l3_end;        // End of the IP datagram (excludes ethernet padding)
+	int l4;            // End of the IP header, where TCP/UDP starts
+	int l4_csum;       // Offset of the TCP/UDP checksum field, or -1
+	int udp_len;       // Offset of the UDP length field, or -1
+	uint16_t ip_length;  // What the IP and UDP length fields should hold, in
+	uint16_t udp_length; // network order
+	uint8_t version;
+	uint8_t proto;
+	bool l3_dirty;     // Needs a full recompute rather than an update
+	bool l4_dirty;
+	bool fields_hit;   // A length or protocol field was corrupted
+};
+
+uint32_t csum_partial(const void *data, size_t len, uint32_t sum);
+uint16_t csum_fold(uint32_t sum);
+
+bool csum_parse(const char *data, int len, csum_info_t &info);
+void csum_update_byte(char *data, csum_info_t &info, int index, char old);
+void csum_truncate(char *data, csum_info_t &info, int new_len);
+void csum_finish(char *data, csum_info_t &info);
@@ -0,0 +1,149 @@
+#include <string.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+
+#include <algorithm>
+
+#include "classify.h"
+
+
+static inline void mask_key(class_key_t &out, const class_key_t &key,
+							const class_key_t &mask){
+	for (int i=0; i<6; ++i) out.w[i] = key.w[i] & mask.w[i];
+}
+
+
+// Pull the matchable fields out of a frame; absent fields are left as 0
+void frame_key(const char *data, int len, class_key_t &key){
+	const uint8_t *p = (const uint8_t *)data;
+	memset(&key, 0, sizeof(key));
+	if (len < ETH_HLEN) return;
+	int off = 12;
+	uint16_t ethertype = (p[off] << 8) | p[off + 1];
+	if ((ethertype == ETH_P_8021Q || ethertype == ETH_P_8021AD) && off + 6 <= len){
+		key.f.vlan = ((p[off + 2] << 8) | p[off + 3]) & 0xfff;
+	}
+	while ((ethertype == ETH_P_8021Q || ethertype == ETH_P_8021AD)
+		   && off + 6 <= len){
+		off += 4;
+		ethertype = (p[off] << 8) | p[off + 1];
+	}
+	key.f.ethertype = ethertype;
+	off += 2;
+	int l4;
+	if (ethertype == ETH_P_IP && off + 20 <= len){
+		key.f.proto = p[off + 9];
+		memcpy(key.f.src, &p[off + 12], 4);
+		memcpy(key.f.dst, &p[off + 16], 4);
+		// Only the first fragment carries the ports
+		if (((p[off + 6] & 0x1f) | p[off + 7]) != 0) return;
+		l4 = off + (p[off] & 0xf) * 4;
+	} else if (ethertype == ETH_P_IPV6 && off + 40 <= len){
+		key.f.proto = p[off + 6];
+		memcpy(key.f.src, &p[off + 8], 16);
+		memcpy(key.f.dst, &p[off + 24], 16);
+		l4 = off + 40;
+	} else {
+		return;
+	}
+	uint8_t proto = key.f.proto;
+	if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP || proto == IPPROTO_SCTP)
+		&& l4 + 4 <= len){
+		key.f.src_port = (p[l4] << 8) | p[l4 + 1];
+		key.f.dst_port = (p[l4 + 2] << 8) | p[l4 + 3];
+	}
+}
+
+
+void classifier_clear(classifier_t &c){
+	c.tuples.clear();
+	c.cache.clear();
+	c.rules = 0;
+}
+
+
+// Rules added earlier take priority over later ones
+void classifier_add(classifier_t &c, const class_key_t &key,
+					const class_key_t &mask, int profile){
+	class_entry_t entry;
+	mask_key(entry.key, key, mask);
+	entry.rule = c.rules++;
+	entry.profile = profile;
+	for (size_t i=0; i<c.tuples.size(); ++i){
+		if (key_equal(c.tuples[i].mask, mask)){
+			c.tuples[i].entries.push_back(entry);
+			return;
+		}
+	}
+	class_tuple_t tuple;
+	tuple.mask = mask;
+	tuple.first_rule = entry.rule;
+	tuple.entries.push_back(entry);
+	c.tuples.push_back(tuple);
+}
+
+
+// Build each tuple's open addressing table, at most half full
+void classifier_compile(classifier_t &c){
+	for (size_t i=0; i<c.tuples.size(); ++i){
+		class_tuple_t &tuple = c.tuples[i];
+		size_t size = 2;
+		while (size < tuple.entries.size() * 2) size *= 2;
+		class_entry_t empty;
+		memset(&empty, 0, sizeof(empty));
+		empty.rule = -1;
+		tuple.table.assign(size, empty);
+		for (size_t e=0; e<tuple.entries.size(); ++e){
+			const class_entry_t &entry = tuple.entries[e];
+			size_t slot = key_hash(entry.key) & (size - 1);
+			while (tuple.table[slot].rule >= 0
+				   && !key_equal(tuple.table[slot].key, entry.key)){
+				slot = (slot + 1) & (size - 1);
+			}
+			// Duplicate keys: the earlier rule already has the slot
+			if (tuple.table[slot].rule < 0) tuple.table[slot] = entry;
+		}
+	}
+	std::sort(c.tuples.begin(), c.tuples.end(),
+			  [](const class_tuple_t &a, const class_tuple_t &b){
+				  return a.first_rule < b.first_rule;
+			  });
+	// An all-ones ethertype never comes out of frame_key()
+	class_cache_t empty;
+	memset(&empty, 0xff, sizeof(empty));
+	c.cache.assign(CLASS_CACHE_SIZE, empty);
+}
+
+
+// The profile of the first rule matching the frame, or 0 if none do
+int classify(classifier_t &c, const class_key_t &key){
+	if (c.tuples.empty()) return 0;
+	class_cache_t &cached = c.cache[key_hash(key) % CLASS_CACHE_SIZE];
+	if (key_equal(cached.key, key)) return cached.profile;
+	int best = INT_MAX;
+	int profile = 0;
+	for (size_t i=0; i<c.tuples.size(); ++i){
+		const class_tuple_t &tuple = c.tuples[i];
+		// Tuples are in order of their best rule, nothing later can win
+		if (tuple.first_rule > best) break;
+		class_key_t masked;
+		mask_key(masked, key, tuple.mask);
+		size_t size_mask = tuple.table.size() - 1;
+		size_t slot = key_hash(masked) & size_mask;
+		while (tuple.table[slot].rule >= 0){
+			const class_entry_t &entry = tuple.table[slot];
+			if (key_equal(entry.key, masked)){
+				if (entry.rule < best){
+					best = entry.rule;
+					profile = entry.profile;
+				}
+				break;
+			}
+			slot = (slot + 1) & size_mask;
+		}
+	}
+	cached.key = key;
+	cached.profile = profile;
+	return profile;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+
+#include <vector>
+
+// Most impairment profiles, including the default one at index 0
+static const int PROFILES_MAX = 64;
+
+// The fields rules can match on, pulled out of a frame
+struct class_fields_t{
+	uint16_t ethertype;
+	uint16_t vlan;
+	uint8_t proto;
+	uint8_t pad[3];
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint32_t pad2;
+	uint8_t src[16];
+	uint8_t dst[16];
+};
+
+union class_key_t{
+	class_fields_t f;
+	uint64_t w[6];
+};
+
+static inline bool key_equal(const class_key_t &a, const class_key_t &b){
+	return ((a.w[0] ^ b.w[0]) | (a.w[1] ^ b.w[1]) | (a.w[2] ^ b.w[2])
+			| (a.w[3] ^ b.w[3]) | (a.w[4] ^ b.w[4]) | (a.w[5] ^ b.w[5])) == 0;
+}
+
+
+// Independent multiplies, so the words hash in parallel
+static inline uint64_t key_hash(const class_key_t &key){
+	uint64_t h = (key.w[0] ^ key.w[3]) * 0x9e3779b97f4a7c15ull
+		+ (key.w[1] ^ key.w[4]) * 0xc2b2ae3d27d4eb4full
+		+ (key.w[2] ^ key.w[5]) * 0x165667b19e3779f9ull;
+	return h ^ (h >> 29);
+}
+
+struct class_entry_t{
+	class_key_t key;
+	int rule;
+	int profile;
+};
+
+/* Tuple space search: rules that match on the same fields, with the same
+ * prefix lengths, share a mask and a hash table.  A frame costs one masked
+ * hash probe per distinct mask, not one comparison per rule.
+ */
+struct class_tuple_t{
+	class_key_t mask;
+	int first_rule;
+	std::vector<class_entry_t> entries;
+	std::vector<class_entry_t> table;
+};
+
+// Exact match cache in front of the tuples, as a flow's frames all match
+// the same way
+static const int CLASS_CACHE_SIZE = 4096;
+
+struct class_cache_t{
+	class_key_t key;
+	int profile;
+};
+
+struct classifier_t{
+	std::vector<class_tuple_t> tuples;
+	std::vector<class_cache_t> cache;
+	int rules;
+};
+
+void classifier_clear(classifier_t &c);
+void classifier_add(classifier_t &c, const class_key_t &key,
+					const class_key_t &mask, int profile);
+void classifier_compile(classifier_t &c);
+void frame_key(const char *data, int len, class_key_t &key);
+int classify(classifier_t &c, const class_key_t &key);
@@ -1,25 +1,412 @@
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <new>
+
 #include "filter.h"
+#include "config.h"
 #include "parser_UTF8.h"
+#include "queue.h"
+#include "reorder.h"
+#include "dist.h"
 
 static const char *CONFIG_PATH = "/etc/brokenhub.conf";
 
 #define UIMAX(size) (size)(((1ull << ((sizeof(size) * 8)-1)) - 1) | ((0xffull << ((sizeof(size) * 8) - 1))))
 
-JSON::value read_or_abort(JSON::value parent, const char* key){
-	if (!parent.childexists(key)){
+/* Where a setting is looked up, most specific first: a VLAN's direction
+ * objects and then the VLAN's object, the same for the bridge, then for the
+ * top level.  Profiles and rules only have the one layer.
+ */
+static const int SCOPES = 3;
+static const int NODE_LAYERS = 3 * SCOPES;
+
+struct node_t{
+	JSON::value *layers[NODE_LAYERS];
+
+	JSON::value *find(const char *key) const{
+		for (int i=0; i<NODE_LAYERS; ++i){
+			if (layers[i] && layers[i]->childexists(key)){
+				return &layers[i]->getchild(key);
+			}
+		}
+		return NULL;
+	}
+};
+
+JSON::value *child_or_null(JSON::value *parent, const char *key){
+	if (!parent || !parent->childexists(key)) return NULL;
+	return &parent->getchild(key);
+}
+
+JSON::value read_or_abort(const node_t &parent, const char* key){
+	JSON::value *child = parent.find(key);
+	if (!child){
 		fprintf(stderr, "Error: Config item '%s' missing\n", key);
 		abort();
 	}
-	return parent.getchild(key);
+	return *child;
+}
+
+JSON::value read_or_default(const node_t &parent, const char* key, 
+							JSON::value _default){
+	JSON::value *child = parent.find(key);
+	if (!child) return _default;
+	return *child;
 }
 
 unsigned long percent_to_long(float perc){
+	// 100% would overflow the conversion
+	if (perc >= 100) return UIMAX(unsigned long);
 	return (unsigned long)((perc / 100.0) * UIMAX(unsigned long));
 }
 
-void load_config(){
+// KiB/s as ns per byte, 0 meaning unlimited
+unsigned long read_bandwidth(JSON::value bandwidth_value){
+	if (bandwidth_value.getinteger() == 0) return 0;
+	float bandwidth_kps = bandwidth_value.getfloat();
+	unsigned long bandwidth_nspb = (1.0/(bandwidth_kps * 1024)) * 1000000000;
+	return bandwidth_nspb;
+}
+
+// The top level keeps its historical required keys; profiles default to 0
+JSON::value read_profile_key(const node_t &node, const char *key, bool required){
+	if (required) return read_or_abort(node, key);
+	return read_or_default(node, key, 0);
+}
+
+void load_delay(const node_t &node, profile_t &profile){
+	profile.delay = read_or_default(node, "delay_us", 0).getinteger() * NS_PER_US;
+	profile.jitter = read_or_default(node, "jitter_us", 0).getinteger() * NS_PER_US;
+	float correlation = read_or_default(node, "delay_correlation", 0).getfloat();
+	profile.delay_correlation = percent_to_long(correlation);
+	profile.delay_dist.table.clear();
+	profile.delay_dist.absolute = false;
+
+	std::string path;
+	if (JSON::value *samples = node.find("delay_samples")){
+		samples->getstring(path);
+		dist_load_samples(profile.delay_dist, path.c_str());
+	} else if (JSON::value *distribution = node.find("delay_distribution")){
+		distribution->getstring(path);
+		if (path != "uniform") dist_load_table(profile.delay_dist, path.c_str());
+	}
+
+	// The longest delay a frame can be given, to size the delay line with
+	const std::vector<int64_t> &table = profile.delay_dist.table;
+	int64_t widest = profile.jitter;
+	if (!table.empty()){
+		int64_t low = *std::min_element(table.begin(), table.end());
+		int64_t high = *std::max_element(table.begin(), table.end());
+		widest = std::max(-low, high) * (int64_t)profile.jitter / DIST_SCALE;
+	}
+	profile.delay_max = profile.delay_dist.absolute
+		? *std::max_element(table.begin(), table.end())
+		: profile.delay + widest;
+}
+
+void load_profile(const node_t &node, profile_t &profile, bool top_level){
+	float drop_percent = read_profile_key(node, "drop_percent", top_level).getfloat();
+	profile.drop = percent_to_long(drop_percent);
+	float drop_correlation = read_or_default(node, "drop_correlation", 
+											 0).getfloat();
+	profile.drop_correlation = percent_to_long(drop_correlation);
+	profile.drop_nth = read_or_default(node, "drop_nth", 0).getinteger();
+	float corrupt_percent = read_profile_key(node, "corrupt_packet_percent", 
+											 top_level).getfloat();
+	profile.corrupt_packets = percent_to_long(corrupt_percent);
+	profile.corrupt_bytes = read_profile_key(node, "corrupt_packet_bytes", 
+											 top_level).getinteger();
+	profile.truncate_len = read_profile_key(node, "truncate_len", 
+											top_level).getinteger();
+	// The top level is already limited by the link's bandwidth
+	profile.rate = top_level ? 0 : read_bandwidth(read_or_default(node, "rate", 0));
+	profile.flow_rate = read_bandwidth(read_or_default(node, "flow_rate", 0));
+	load_delay(node, profile);
+}
+
+int read_protocol(JSON::value protocol){
+	std::string name;
+	if (protocol.getdatatype() != JSON::datatype::_string){
+		return protocol.getinteger();
+	}
+	protocol.getstring(name);
+	if (name == "icmp") return IPPROTO_ICMP;
+	if (name == "tcp") return IPPROTO_TCP;
+	if (name == "udp") return IPPROTO_UDP;
+	if (name == "icmpv6") return IPPROTO_ICMPV6;
+	if (name == "sctp") return IPPROTO_SCTP;
+	fprintf(stderr, "Error: Unknown protocol '%s'\n", name.c_str());
+	abort();
+}
+
+// "10.1.0.0/16" or "fd00::/8", which also pins the rule's ethertype
+void read_prefix(JSON::value value, class_key_t &key, class_key_t &mask,
+				 uint8_t *addr, uint8_t *addr_mask){
+	std::string text;
+	value.getstring(text);
+	size_t slash = text.find('/');
+	std::string address = text.substr(0, slash);
+	uint16_t ethertype = ETH_P_IP;
+	int bits = 32;
+	if (inet_pton(AF_INET, address.c_str(), addr) != 1){
+		ethertype = ETH_P_IPV6;
+		bits = 128;
+		if (inet_pton(AF_INET6, address.c_str(), addr) != 1){
+			fprintf(stderr, "Error: Bad address '%s'\n", text.c_str());
+			abort();
+		}
+	}
+	if (slash != std::string::npos){
+		int prefix = atoi(text.c_str() + slash + 1);
+		if (prefix < 0 || prefix > bits){
+			fprintf(stderr, "Error: Bad prefix length in '%s'\n", text.c_str());
+			abort();
+		}
+		bits = prefix;
+	}
+	for (int i=0; i<bits; ++i) addr_mask[i / 8] |= 0x80 >> (i % 8);
+	if (mask.f.ethertype && key.f.ethertype != ethertype){
+		fprintf(stderr, "Error: Rule mixes address families\n");
+		abort();
+	}
+	key.f.ethertype = ethertype;
+	mask.f.ethertype = 0xffff;
+}
+
+/* Rules are tried in order, the first match picking the frame's profile:
+ *   {"profile": "video", "vlan": 10, "ethertype": 2048, "protocol": "udp",
+ *    "src": "10.0.0.0/8", "dst": "10.1.2.3", "src_port": 5004, 
+ *    "dst_port": 5004, "port": 22}
+ * "port" matches either the source or destination port.
+ */
+void load_rules(const node_t &node, direction_config_t &config,
+				std::map<std::string, int> &profiles){
+	classifier_clear(config.classifier);
+	JSON::value *rules_value = node.find("rules");
+	if (!rules_value) return;
+	raw_array_t &rules = rules_value->getrawarray();
+	for (JSON::value *rule : rules){
+		std::string name;
+		read_or_abort(node_t{{rule}}, "profile").getstring(name);
+		if (!profiles.count(name)){
+			fprintf(stderr, "Error: Rule uses unknown profile '%s'\n", name.c_str());
+			abort();
+		}
+		class_key_t key, mask;
+		memset(&key, 0, sizeof(key));
+		memset(&mask, 0, sizeof(mask));
+		if (rule->childexists("ethertype")){
+			key.f.ethertype = rule->getchild("ethertype").getinteger();
+			mask.f.ethertype = 0xffff;
+		}
+		if (rule->childexists("vlan")){
+			key.f.vlan = rule->getchild("vlan").getinteger();
+			mask.f.vlan = 0xffff;
+		}
+		if (rule->childexists("protocol")){
+			key.f.proto = read_protocol(rule->getchild("protocol"));
+			mask.f.proto = 0xff;
+		}
+		if (rule->childexists("src_port")){
+			key.f.src_port = rule->getchild("src_port").getinteger();
+			mask.f.src_port = 0xffff;
+		}
+		if (rule->childexists("dst_port")){
+			key.f.dst_port = rule->getchild("dst_port").getinteger();
+			mask.f.dst_port = 0xffff;
+		}
+		if (rule->childexists("src")){
+			read_prefix(rule->getchild("src"), key, mask, key.f.src, mask.f.src);
+		}
+		if (rule->childexists("dst")){
+			read_prefix(rule->getchild("dst"), key, mask, key.f.dst, mask.f.dst);
+		}
+		int profile = profiles[name];
+		if (rule->childexists("port")){
+			int port = rule->getchild("port").getinteger();
+			class_key_t either = key;
+			class_key_t either_mask = mask;
+			key.f.src_port = port;
+			mask.f.src_port = 0xffff;
+			either.f.dst_port = port;
+			either_mask.f.dst_port = 0xffff;
+			classifier_add(config.classifier, either, either_mask, profile);
+		}
+		classifier_add(config.classifier, key, mask, profile);
+	}
+	classifier_compile(config.classifier);
+}
+
+void load_profiles(const node_t &node, direction_config_t &config){
+	std::map<std::string, int> names;
+	config.profiles.resize(1);
+	load_profile(node, config.profiles[0], true);
+	names["default"] = 0;
+	if (JSON::value *profiles_value = node.find("profiles")){
+		raw_object_t &profiles = profiles_value->getrawobject();
+		for (raw_object_t::iterator it = profiles.begin(); 
+			 it != profiles.end(); ++it){
+			if (config.profiles.size() == PROFILES_MAX){
+				fprintf(stderr, "Error: More than %i profiles\n", PROFILES_MAX);
+				abort();
+			}
+			names[it->first] = config.profiles.size();
+			config.profiles.push_back(profile_t());
+			load_profile(node_t{{it->second}}, config.profiles.back(), false);
+		}
+	}
+	config.delay_max = 0;
+	bool per_flow = false;
+	for (const profile_t &profile : config.profiles){
+		unsigned long longest = profile.delay_max;
+		if (profile.rate || profile.flow_rate) longest += RATE_BACKLOG_NS;
+		config.delay_max = std::max(config.delay_max, longest);
+		per_flow |= profile.drop_correlation || profile.drop_nth || profile.flow_rate;
+	}
+	long flow_table_size = per_flow 
+		? read_or_default(node, "flow_table_size", 
+						  (long)FLOW_TABLE_DEFAULT).getinteger()
+		: 0;
+	// filter() counts on a flow for every frame such a profile sees
+	if (per_flow && flow_table_size < 1){
+		fprintf(stderr, "Error: flow_table_size must be at least 1\n");
+		abort();
+	}
+	config.flow_table_size = flow_table_size;
+	load_rules(node, config, names);
+}
+
+/* Frames leaving through a port are configured by a "to_<interface>"
+ * object; with just two ports, "a_to_b" and "b_to_a" work too.
+ */
+void load_direction(JSON::value **scopes, const std::vector<std::string> &ports,
+					int port, direction_config_t &config){
+	std::string to = "to_" + ports[port];
+	const char *legacy = NULL;
+	if (ports.size() == 2) legacy = port ? "a_to_b" : "b_to_a";
+	node_t node;
+	for (int i=0; i<SCOPES; ++i){
+		node.layers[3 * i] = child_or_null(scopes[i], to.c_str());
+		node.layers[3 * i + 1] = legacy ? child_or_null(scopes[i], legacy) : NULL;
+		node.layers[3 * i + 2] = scopes[i];
+	}
+	load_profiles(node, config);
+	config.repair_checksums = read_or_default(node, "repair_checksums", 
+											  false).getbool();
+
+	float reorder_percent = read_or_default(node, "reorder_percent", 0).getfloat();
+	config.reorder = percent_to_long(reorder_percent);
+	float reorder_correlation = read_or_default(node, "reorder_correlation", 
+												0).getfloat();
+	config.reorder_correlation = percent_to_long(reorder_correlation);
+	config.reorder_distance = read_or_default(node, "reorder_distance", 
+											  0).getinteger();
+	config.reorder_delay = read_or_default(node, "reorder_delay_us", 
+										   0).getinteger() * NS_PER_US;
+	if (config.reorder && !config.reorder_distance == !config.reorder_delay){
+		fprintf(stderr, "Error: reorder_percent needs exactly one of "
+				"reorder_distance and reorder_delay_us\n");
+		abort();
+	}
+	if (config.reorder_distance >= REORDER_SLOTS){
+		fprintf(stderr, "Error: reorder_distance must be below %i\n", 
+				REORDER_SLOTS);
+		abort();
+	}
+
+	float duplicate_percent = read_or_default(node, "duplicate_percent", 
+											  0).getfloat();
+	config.duplicate = percent_to_long(duplicate_percent);
+	config.duplicate_copies = read_or_default(node, "duplicate_copies", 
+											  1).getinteger();
+	config.duplicate_delay = read_or_default(node, "duplicate_delay_us", 
+											 0).getinteger() * NS_PER_US;
+
+	config.slot_min = read_or_default(node, "slot_min_us", 0).getinteger() * NS_PER_US;
+	config.slot_max = read_or_default(node, "slot_max_us", 
+									  (long)(config.slot_min / NS_PER_US)).getinteger() * NS_PER_US;
+	config.slot_packets = read_or_default(node, "slot_packets", 0).getinteger();
+	config.slot_bytes = read_or_default(node, "slot_bytes", 0).getinteger();
+	if (config.slot_max < config.slot_min){
+		fprintf(stderr, "Error: slot_max_us is below slot_min_us\n");
+		abort();
+	}
+
+	config.bandwidth = read_bandwidth(read_or_abort(node, "bandwidth"));
+}
+
+
+void load_link(JSON::value **scopes, config_t &config, int vlan){
+	link_config_t *&link = config.links[vlan];
+	if (!link){
+		void *memory;
+		// Directions are cache line aligned, which plain new doesn't promise
+		if (posix_memalign(&memory, 64, sizeof(link_config_t))){
+			fprintf(stderr, "Error: Out of memory for VLAN %i\n", vlan);
+			abort();
+		}
+		link = new (memory) link_config_t();
+	}
+	for (size_t port=0; port<config.ports.size(); ++port){
+		load_direction(scopes, config.ports, port, link->out[port]);
+	}
+}
+
+
+/* Settings at the top level apply to every port; "to_<interface>" objects
+ * override any of them for frames sent out of that interface.  A "vlans"
+ * object gives VLAN IDs links of their own, each overriding the top level
+ * in the same way:
+ *   "vlans": {"10": {"delay_us": 600000, "to_eth0": {"bandwidth": 64}}}
+ * A bridge from the "bridges" list overrides the top level, and its VLANs
+ * override it in turn.
+ */
+void load_bridge(JSON::value &root, JSON::value *bridge, config_t &config){
+	JSON::value *scopes[SCOPES] = {NULL, bridge, &root};
+	load_link(scopes, config, 0);
+
+	node_t node = {{bridge, &root}};
+	config.mirror.clear();
+	if (JSON::value *mirror = node.find("mirror")) mirror->getstring(config.mirror);
+	config.mirror_dropped_vlan = read_or_default(node, "mirror_dropped_vlan", 
+												 0).getinteger();
+	if (config.mirror_dropped_vlan < 0 
+		|| config.mirror_dropped_vlan >= VLAN_COUNT - 1){
+		fprintf(stderr, "Error: Bad mirror_dropped_vlan %i\n", 
+				config.mirror_dropped_vlan);
+		abort();
+	}
+
+	config.vlans.clear();
+	JSON::value *vlans_value = child_or_null(bridge, "vlans");
+	if (!vlans_value) vlans_value = child_or_null(&root, "vlans");
+	if (!vlans_value) return;
+	raw_object_t &vlans = vlans_value->getrawobject();
+	for (raw_object_t::iterator it = vlans.begin(); it != vlans.end(); ++it){
+		std::string name = it->first;
+		char *end;
+		long vlan = strtol(name.c_str(), &end, 10);
+		// 0 and 4095 are reserved, and untagged frames use the top level
+		if (name.empty() || *end || vlan < 1 || vlan >= VLAN_COUNT - 1){
+			fprintf(stderr, "Error: Bad VLAN ID '%s'\n", name.c_str());
+			abort();
+		}
+		scopes[0] = it->second;
+		load_link(scopes, config, vlan);
+		config.vlans.push_back(vlan);
+	}
+}
+
+
+void read_config(JSON::value &root){
 	JSON::parser_UTF8 parser;
-	JSON::value root;
 	parser.parsefile(root, CONFIG_PATH);
 	if (parser.fail()){
 		fprintf(stderr, "Could not read config\n");
@@ -28,20 +415,115 @@ void load_config(){
 		}
 		abort();
 	}
-	float drop_percent = read_or_abort(root, "drop_percent").getfloat();
-	config.drop = percent_to_long(drop_percent);
-	float corrupt_percent = read_or_abort(root, "corrupt_packet_percent").getfloat();
-	config.corrupt_packets = percent_to_long(corrupt_percent);
-	int corrupt_bytes = read_or_abort(root, "corrupt_packet_bytes").getinteger();
-	config.corrupt_bytes = corrupt_bytes;
-	config.truncate_len = read_or_abort(root, "truncate_len").getinteger();
-	
-	JSON::value bandwidth_value = read_or_abort(root, "bandwidth");
-	if (bandwidth_value.getinteger() == 0){
-		config.bandwidth = 0;
-	} else {
-		float bandwidth_kps = bandwidth_value.getfloat();
-		unsigned long bandwidth_nspb = (1.0/(bandwidth_kps * 1024)) * 1000000000;
-		config.bandwidth = bandwidth_nspb;
+}
+
+
+void load_config(config_t *const *configs, const int *bridges, int count){
+	JSON::value root;
+	read_config(root);
+	JSON::value *list = child_or_null(&root, "bridges");
+	for (int i=0; i<count; ++i){
+		JSON::value *bridge = NULL;
+		if (bridges[i] >= 0){
+			if (!list || (size_t)bridges[i] >= list->getrawarray().size()){
+				fprintf(stderr, "Error: Bridge %i gone from the config\n", 
+						bridges[i]);
+				abort();
+			}
+			bridge = list->getrawarray()[bridges[i]];
+		}
+		load_bridge(root, bridge, *configs[i]);
+	}
+}
+
+
+void free_config(config_t &config){
+	for (int vlan=0; vlan<VLAN_COUNT; ++vlan){
+		if (!config.links[vlan]) continue;
+		config.links[vlan]->~link_config_t();
+		free(config.links[vlan]);
+		config.links[vlan] = NULL;
+	}
+}
+
+
+// How a bridge's work is divided between threads
+static void read_threading(const node_t &node, bridge_spec_t &spec){
+	spec.split = read_or_default(node, "split_directions", false).getbool();
+	if (spec.split && spec.interfaces.size() != 2){
+		fprintf(stderr, "Error: split_directions needs exactly 2 interfaces\n");
+		abort();
+	}
+	spec.queues = read_or_default(node, "queues", 1).getinteger();
+	if (spec.queues < 1 || (spec.split && spec.queues > 1)){
+		fprintf(stderr, "Error: queues must be at least 1, and 1 with "
+				"split_directions\n");
+		abort();
+	}
+}
+
+
+static void load_bridge_specs(JSON::value &root, JSON::value &list, 
+							  std::vector<bridge_spec_t> &bridges){
+	for (JSON::value *bridge : list.getrawarray()){
+		bridge_spec_t spec;
+		read_or_abort(node_t{{bridge}}, "name").getstring(spec.name);
+		JSON::value *interfaces = child_or_null(bridge, "interfaces");
+		if (!interfaces){
+			fprintf(stderr, "Error: Bridge '%s' has no 'interfaces'\n", 
+					spec.name.c_str());
+			abort();
+		}
+		for (JSON::value *interface : interfaces->getrawarray()){
+			std::string name;
+			interface->getstring(name);
+			spec.interfaces.push_back(name);
+		}
+		if (spec.interfaces.size() < 2 || spec.interfaces.size() > PORTS_MAX){
+			fprintf(stderr, "Error: Bridge '%s' needs 2 to %i interfaces\n", 
+					spec.name.c_str(), PORTS_MAX);
+			abort();
+		}
+		read_threading(node_t{{bridge, &root}}, spec);
+		bridges.push_back(spec);
+	}
+}
+
+
+/* These are read once at startup:
+ *   "workers": 16,
+ *   "cpus": [2, 3, 4, 5],
+ *   "bridges": [{"name": "bench1", "interfaces": ["veth0", "veth1"], ...}]
+ * The bridges come from the config when 'daemon' is set, otherwise the one
+ * given on the command line must already be there.
+ */
+void load_startup(startup_t &startup, bool daemon){
+	JSON::value root;
+	read_config(root);
+	node_t top = {{&root}};
+	JSON::value *list = child_or_null(&root, "bridges");
+	if (daemon && !list){
+		fprintf(stderr, "Error: Config item 'bridges' missing\n");
+		abort();
+	}
+	if (!daemon) read_threading(top, startup.bridges[0]);
+	else load_bridge_specs(root, *list, startup.bridges);
+	startup.workers = read_or_default(top, "workers", 0).getinteger();
+	startup.steal = read_or_default(top, "steal_work", false).getbool();
+	startup.busy_poll = read_or_default(top, "busy_poll_us", 0).getinteger();
+	startup.spin_idle = read_or_default(top, "spin_idle_us", 0).getinteger();
+	startup.realtime = read_or_default(top, "realtime_priority", 0).getinteger();
+	startup.hugepages = read_or_default(top, "hugepages", false).getbool();
+	startup.uring = read_or_default(top, "io_uring", false).getbool();
+	startup.sqpoll = read_or_default(top, "io_uring_sqpoll", false).getbool();
+	startup.gso = read_or_default(top, "gso", false).getbool();
+	startup.qdisc_bypass = read_or_default(top, "qdisc_bypass", false).getbool();
+	startup.ignore_outgoing = read_or_default(top, "ignore_outgoing", 
+											  false).getbool();
+	startup.cpus.clear();
+	if (JSON::value *cpus = top.find("cpus")){
+		for (JSON::value *cpu : cpus->getrawarray()){
+			startup.cpus.push_back(cpu->getinteger());
+		}
 	}
 }
@@ -1,2 +1,57 @@
+#pragma once
+#include <string>
+#include <vector>
 
-void load_config();
+#include "filter.h"
+
+// A bridge of the daemon's "bridges" list
+struct bridge_spec_t{
+	std::string name;
+	std::vector<std::string> interfaces;
+	// Run each direction of a two port bridge on a thread of its own
+	bool split;
+	// Run this many copies, each on a thread of its own with a queue of
+	// each TAP device and a share of each interface's frames
+	int queues;
+};
+
+// Settings only read at startup
+struct startup_t{
+	std::vector<bridge_spec_t> bridges;
+	// 0 for one per CPU
+	int workers;
+	// Workers are pinned to these in turn, if any are given
+	std::vector<int> cpus;
+	// Let idle workers impair frames for busy ones
+	bool steal;
+	// Workers spin rather than sleep, and sockets busy poll this long; 0
+	// for neither
+	int busy_poll;
+	// Workers spin only until nothing has come in for this long; 0 to spin
+	// for good, with busy_poll
+	int spin_idle;
+	// SCHED_FIFO priority for the workers, with all memory locked; 0 for
+	// neither
+	int realtime;
+	// Take packet buffers from 2MB huge pages
+	bool hugepages;
+	// Workers do their I/O through an io_uring rather than epoll, with a
+	// kernel thread submitting for each if 'sqpoll'
+	bool uring;
+	bool sqpoll;
+	// Read GSO frames whole, with PACKET_VNET_HDR, and send them on whole
+	bool gso;
+	// Packet sockets send past the devices' qdiscs, and don't read what
+	// leaves through their interfaces
+	bool qdisc_bypass;
+	bool ignore_outgoing;
+};
+
+/* Load the configs of several bridges from one reading of the file.  A
+ * bridge index of -1 means the top level alone, for a single bridge given
+ * its interfaces on the command line.  Each config's ports must be set.
+ */
+void load_config(config_t *const *configs, const int *bridges, int count);
+// Free what loading allocated
+void free_config(config_t &config);
+void load_startup(startup_t &startup, bool daemon);
@@ -0,0 +1,30 @@
+#pragma once
+#include <time.h>
+
+#include "filter.h"
+#include "queue.h"
+#include "reorder.h"
+#include "transmit.h"
+#include "flow.h"
+
+struct direction_stats_t{
+	uint64_t received;
+	uint64_t dropped;
+	uint64_t sent;
+	uint64_t sent_bytes;
+};
+
+/* Everything one direction of traffic touches on its way through: frames
+ * read from one interface and written to the other.  Aligned so the two
+ * directions' state never shares a cache line.
+ */
+struct alignas(64) direction_t{
+	direction_config_t *config;
+	rand_state_t rand;
+	direction_stats_t stats;
+	queue_t queue;
+	timespec queue_time;
+	slot_t slot;
+	flow_table_t flows;
+	reorder_t reorder;
+};
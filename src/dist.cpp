@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "dist.h"
+#include "queue.h"
+
+// Where iproute2 installs normal, pareto, paretonormal etc.
+static const char *DIST_DIRS[] = {
+	"/usr/lib/tc",
+	"/usr/lib64/tc",
+	"/usr/lib/x86_64-linux-gnu/tc",
+	"/usr/share/tc",
+	NULL
+};
+
+
+// Map a whitespace separated list of integers, with # comments, into 'out'
+static bool read_numbers(const char *path, std::vector<int64_t> &out){
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0){
+		close(fd);
+		return false;
+	}
+	const char *text = (const char *)mmap(NULL, st.st_size, PROT_READ, 
+										  MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (text == MAP_FAILED) return false;
+	const char *p = text;
+	const char *end = text + st.st_size;
+	while (p < end){
+		if (*p == '#'){
+			while (p < end && *p != '\n') ++p;
+		} else if (*p == '-' || (*p >= '0' && *p <= '9')){
+			bool negative = (*p == '-');
+			if (negative) ++p;
+			int64_t value = 0;
+			while (p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+			out.push_back(negative ? -value : value);
+		} else {
+			++p;
+		}
+	}
+	munmap((void *)text, st.st_size);
+	return true;
+}
+
+
+void dist_load_table(dist_t &dist, const char *name){
+	dist.table.clear();
+	dist.absolute = false;
+	bool found = false;
+	if (strchr(name, '/')){
+		found = read_numbers(name, dist.table);
+	} else {
+		char path[256];
+		for (int i=0; DIST_DIRS[i] && !found; ++i){
+			snprintf(path, sizeof(path), "%s/%s.dist", DIST_DIRS[i], name);
+			found = read_numbers(path, dist.table);
+		}
+	}
+	if (!found || dist.table.empty()){
+		fprintf(stderr, "Error: Could not read delay distribution '%s'\n", name);
+		abort();
+	}
+}
+
+
+void dist_load_samples(dist_t &dist, const char *path){
+	std::vector<int64_t> samples;
+	if (!read_numbers(path, samples) || samples.empty()){
+		fprintf(stderr, "Error: Could not read delay samples '%s'\n", path);
+		abort();
+	}
+	std::sort(samples.begin(), samples.end());
+	dist.table.resize(DIST_SAMPLE_TABLE);
+	dist.absolute = true;
+	size_t last = samples.size() - 1;
+	for (int i=0; i<DIST_SAMPLE_TABLE; ++i){
+		size_t index = (last * i + (DIST_SAMPLE_TABLE - 1) / 2) / (DIST_SAMPLE_TABLE - 1);
+		dist.table[i] = samples[index] * NS_PER_US;
+	}
+}
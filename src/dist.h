@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+
+#include <vector>
+
+// netem tables hold deviations from the mean in units of sigma / 8192
+static const int64_t DIST_SCALE = 8192;
+// Entries in an inverse CDF built from measured samples
+static const int DIST_SAMPLE_TABLE = 4096;
+
+/* An inverse CDF: a uniformly chosen entry follows the distribution.  Loaded
+ * tables are scaled by jitter around the mean delay; tables built from
+ * samples hold the delays themselves, in ns.
+ */
+struct dist_t{
+	std::vector<int64_t> table;
+	bool absolute;
+};
+
+void dist_load_table(dist_t &dist, const char *name);
+void dist_load_samples(dist_t &dist, const char *path);
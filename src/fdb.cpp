@@ -0,0 +1,63 @@
+#include <string.h>
+
+#include "queue.h"
+#include "fdb.h"
+
+
+// The top bit keeps the key of VLAN 0's all-zero address from looking unused
+static inline uint64_t fdb_key(int vlan, const char *mac){
+	const uint8_t *m = (const uint8_t *)mac;
+	uint64_t key = 1ull << 63 | (uint64_t)vlan << 48;
+	for (int i=0; i<6; ++i) key |= (uint64_t)m[i] << (40 - 8 * i);
+	return key;
+}
+
+
+static inline fdb_bucket_t &fdb_bucket(fdb_t &f, uint64_t key){
+	return f.buckets[(key * 0x9e3779b97f4a7c15ull) >> 52 & (FDB_BUCKETS - 1)];
+}
+
+
+void fdb_clear(fdb_t &f){
+	memset(&f, 0, sizeof(f));
+}
+
+
+void fdb_learn(fdb_t &f, int vlan, const char *mac, int port, uint64_t now){
+	// Group addresses are never a frame's source
+	if (mac[0] & 1) return;
+	uint64_t key = fdb_key(vlan, mac);
+	uint32_t seen = now / NS_PER_SEC;
+	fdb_bucket_t &bucket = fdb_bucket(f, key);
+	fdb_entry_t *oldest = &bucket.ways[0];
+	for (int i=0; i<FDB_WAYS; ++i){
+		fdb_entry_t &entry = bucket.ways[i];
+		if (entry.key == key){
+			// Only write when something changed, to keep the line clean
+			if (entry.seen != seen || entry.port != (uint32_t)port){
+				entry.seen = seen;
+				entry.port = port;
+			}
+			return;
+		}
+		if (!entry.key || entry.seen < oldest->seen) oldest = &entry;
+		if (!entry.key) break;
+	}
+	oldest->key = key;
+	oldest->seen = seen;
+	oldest->port = port;
+}
+
+
+// The port 'mac' was last seen on, or -1 if it's unknown
+int fdb_lookup(fdb_t &f, int vlan, const char *mac, uint64_t now){
+	uint64_t key = fdb_key(vlan, mac);
+	fdb_bucket_t &bucket = fdb_bucket(f, key);
+	for (int i=0; i<FDB_WAYS; ++i){
+		const fdb_entry_t &entry = bucket.ways[i];
+		if (entry.key != key) continue;
+		if (now / NS_PER_SEC - entry.seen >= FDB_AGE_SEC) return -1;
+		return entry.port;
+	}
+	return -1;
+}
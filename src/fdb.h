@@ -0,0 +1,29 @@
+#pragma once
+#include <stdint.h>
+
+/* MAC learning table, as a bridge's forwarding database: which port each
+ * address was last seen on, per VLAN.  Set associative, so a lookup reads
+ * one cache line, and a full bucket replaces its stalest entry.  Entries
+ * not refreshed for FDB_AGE_SEC are forgotten.
+ */
+static const int FDB_WAYS = 4;
+static const int FDB_BUCKETS = 4096;
+static const uint32_t FDB_AGE_SEC = 300;
+
+struct fdb_entry_t{
+	uint64_t key;       // VLAN and address, 0 when unused
+	uint32_t seen;      // Seconds of CLOCK_MONOTONIC
+	uint32_t port;
+};
+
+struct alignas(64) fdb_bucket_t{
+	fdb_entry_t ways[FDB_WAYS];
+};
+
+struct fdb_t{
+	fdb_bucket_t buckets[FDB_BUCKETS];
+};
+
+void fdb_clear(fdb_t &f);
+void fdb_learn(fdb_t &f, int vlan, const char *mac, int port, uint64_t now);
+int fdb_lookup(fdb_t &f, int vlan, const char *mac, uint64_t now);
@@ -1,19 +1,25 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
-#define CONFIG_HERE 
 
 #include "filter.h"
+#include "direction.h"
+#include "checksum.h"
+#include "gso.h"
 
-config_t config;
 
+void rand_seed(rand_state_t &state, unsigned long seed){
+	state.x = 123456789 ^ (seed * 0x9e3779b97f4a7c15ul);
+	state.y = 362436069;
+	state.z = 521288629;
+	state.reorder_last = 0;
+	state.delay_last = 0;
+}
 
-static unsigned long x=123456789, 
-					 y=362436069, 
-					 z=521288629;
 
-unsigned long rand(void) {          //period 2^96-1
+unsigned long rand(rand_state_t &state) {          //period 2^96-1
     unsigned long t;
+    unsigned long &x = state.x, &y = state.y, &z = state.z;
     x ^= x << 16; x ^= x >> 5; x ^= x << 1;
     t = x; x = y; y = z;
     z = t ^ x ^ y;
@@ -21,8 +27,20 @@ unsigned long rand(void) {          //period 2^96-1
 }
 
 
-bool rand_test(unsigned long cutoff){
-	return rand() < cutoff;
+bool rand_test(rand_state_t &state, unsigned long cutoff){
+	return rand(state) < cutoff;
+}
+
+
+// Uniform value correlated with the previous draw, as netem's get_crandom()
+unsigned long crand(rand_state_t &state, unsigned long &last, unsigned long rho){
+	unsigned long value = rand(state);
+	if (rho){
+		value = ((unsigned __int128)value * (~0ul - rho) 
+				 + (unsigned __int128)last * rho) >> 64;
+	}
+	last = value;
+	return value;
 }
 
 
@@ -30,35 +48,162 @@ bool rand_test(unsigned long cutoff){
 #define MIN(x, y) (x > y) ? y : x
 
 
-bool corrupt_packet(char *data, int &len){
-	unsigned long n_bytes = rand() % config.corrupt_bytes;
-	for (int i=0; i<n_bytes; ++i){
-		size_t index = rand() % len;
-		data[index] = rand() % 256;
+bool corrupt_packet(rand_state_t &state, unsigned long max_bytes, char *data, 
+					int &len, csum_info_t *csum){
+	unsigned long n_bytes = rand(state) % max_bytes;
+	for (unsigned long i=0; i<n_bytes; ++i){
+		size_t index = rand(state) % len;
+		char old = data[index];
+		data[index] = rand(state) % 256;
+		if (csum) csum_update_byte(data, *csum, index, old);
 	}	
+	return true;
 }
 
 
-bool drop_packet(char *data, int &len){
-	if (rand_test(config.drop)){
+bool drop_packet(rand_state_t &state, const profile_t &profile, flow_t *flow){
+	if (flow && profile.drop_correlation){
+		return crand(state, flow->drop_last, profile.drop_correlation) >= profile.drop;
+	}
+	if (rand_test(state, profile.drop)){
 		return false;
 	}
 	return true;
 }
 
 
-bool filter(char *data, int &len){
-	if (config.drop){
-		if (!drop_packet(data, len)) return false;
+/* How far to displace a frame from arrival order: 0 leaves it in place,
+ * positive values hold it back and negative values send it ahead of frames
+ * already queued.  Distances are in frames, or ns when reorder_delay is set.
+ */
+long reorder_offset(direction_t &d){
+	const direction_config_t &config = *d.config;
+	if (!config.reorder 
+		|| crand(d.rand, d.rand.reorder_last, 
+				 config.reorder_correlation) >= config.reorder){
+		return 0;
 	}
-	if (config.corrupt_packets 
-	    && config.corrupt_bytes 
-		&& rand_test(config.corrupt_packets)){
-		corrupt_packet(data, len);
+	unsigned long max = config.reorder_delay 
+		? config.reorder_delay 
+		: config.reorder_distance;
+	long offset = 1 + rand(d.rand) % max;
+	return (rand(d.rand) & 1) ? offset : -offset;
+}
+
+
+// How long to hold a frame before queueing it to send, in ns
+uint64_t delay_sample(direction_t &d, const profile_t &profile){
+	if (!profile.delay_max) return 0;
+	unsigned long r = crand(d.rand, d.rand.delay_last, profile.delay_correlation);
+	const std::vector<int64_t> &table = profile.delay_dist.table;
+	int64_t delay;
+	if (!table.empty()){
+		// One draw, one lookup: scale the draw to an index into the table
+		int64_t entry = table[((unsigned __int128)r * table.size()) >> 64];
+		delay = profile.delay_dist.absolute 
+			? entry 
+			: (int64_t)profile.delay + entry * (int64_t)profile.jitter / DIST_SCALE;
+	} else {
+		delay = profile.delay - profile.jitter;
+		if (profile.jitter) delay += r % (2 * profile.jitter);
 	}
-	if (config.truncate_len){
-		len = MIN(len, config.truncate_len);
+	return (delay > 0) ? delay : 0;
+}
+
+
+// Time from one delivery slot to the next, in ns
+uint64_t slot_interval(direction_t &d){
+	unsigned long spread = d.config->slot_max - d.config->slot_min;
+	return d.config->slot_min + (spread ? rand(d.rand) % (spread + 1) : 0);
+}
+
+
+// Extra copies of a frame to send
+int duplicate_count(direction_t &d){
+	if (!d.config->duplicate || !rand_test(d.rand, d.config->duplicate)) return 0;
+	return d.config->duplicate_copies;
+}
+
+
+/* Decide a frame's fate, leaving any changes to its bytes in 'work' for
+ * impair().  'packet' may be swapped for a copy that's safe to change.
+ */
+bool filter(direction_t &d, const profile_t &profile, flow_t *flow, 
+			packet_t *&packet, impair_t &work){
+	work.corrupt_seed = 0;
+	work.truncate_len = 0;
+	if (flow) ++flow->packets;
+	// Profiles asking for this always get a flow
+	if (profile.drop_nth && flow->packets == profile.drop_nth) return false;
+	if (profile.drop){
+		if (!drop_packet(d.rand, profile, flow)){
+			return false;
+		}
 	}
+	bool corrupt = profile.corrupt_packets 
+	    && profile.corrupt_bytes 
+		&& rand_test(d.rand, profile.corrupt_packets);
+	bool truncate = profile.truncate_len 
+		&& (unsigned long)packet->len > profile.truncate_len;
+	if (!corrupt && !truncate) return true;
+	// A frame flooded out of several ports shares one buffer until a port
+	// changes it
+	packet = packet_writable(packet);
+	if (corrupt) work.corrupt_seed = rand(d.rand) | 1;
+	work.corrupt_bytes = profile.corrupt_bytes;
+	if (truncate) work.truncate_len = profile.truncate_len;
+	work.repair = d.config->repair_checksums;
 	return true;
 }
 
+
+/* filter() for a GSO frame standing for 'segments' frames, each dropped as
+ * it would be on its own.  Returns which are, segment i as bit i.  Sets
+ * 'split' if they must go separately: when only some are dropped, or when
+ * their bytes are to change, each then going through filter() itself.
+ */
+uint64_t filter_segments(direction_t &d, const profile_t &profile, flow_t *flow,
+						 const packet_t *packet, int segments, bool &split){
+	const vnet_hdr_t &vnet = packet->vnet;
+	split = segments > 64 
+		|| (profile.corrupt_packets && profile.corrupt_bytes)
+		|| (profile.truncate_len 
+			&& profile.truncate_len < (unsigned long)vnet.hdr_len + vnet.gso_size);
+	if (split) return 0;
+	uint64_t dropped = 0;
+	for (int s=0; s<segments; ++s){
+		if (flow) ++flow->packets;
+		bool drop = profile.drop_nth && flow->packets == profile.drop_nth;
+		if (!drop && profile.drop){
+			drop = !drop_packet(d.rand, profile, flow);
+		}
+		if (drop) dropped |= 1ull << s;
+	}
+	uint64_t all = (segments == 64) ? ~0ull : (1ull << segments) - 1;
+	split = dropped && dropped != all;
+	return dropped;
+}
+
+
+void impair(packet_t *packet, const impair_t &work){
+	if (!work.corrupt_seed && !work.truncate_len) return;
+	// The kernel won't be there to fill in the checksum over changed bytes
+	gso_checksum(packet);
+	char *data = packet->data;
+	int &len = packet->len;
+	csum_info_t csum;
+	bool repair = work.repair && csum_parse(data, len, csum);
+	// What wasn't read can't be taken back out of the checksum
+	if (repair && packet->snapped) csum.l4_dirty = true;
+	if (work.corrupt_seed){
+		rand_state_t state;
+		rand_seed(state, work.corrupt_seed);
+		corrupt_packet(state, work.corrupt_bytes, data, len, repair ? &csum : NULL);
+	}
+	if (work.truncate_len){
+		int new_len = work.truncate_len;
+		if (repair) csum_truncate(data, csum, new_len);
+		len = new_len;
+	}
+	if (repair) csum_finish(data, csum);
+}
@@ -1,15 +1,117 @@
+#pragma once
 #include <stdint.h>
 
-struct config_t{
+#include <vector>
+#include <string>
+
+#include "dist.h"
+#include "classify.h"
+#include "flow.h"
+#include "packet.h"
+
+// Impairments that can differ between classes of traffic
+struct profile_t{
 	unsigned long drop;
+	// Per flow: loss correlated with the flow's previous frame, loss of
+	// its Nth frame and a rate limit on each flow
+	unsigned long drop_correlation;
+	unsigned long drop_nth;
+	unsigned long flow_rate;
 	unsigned long corrupt_packets;
 	unsigned long corrupt_bytes;
-    unsigned long truncate_len;
+	unsigned long truncate_len;
+	unsigned long rate;
+	unsigned long delay;
+	unsigned long jitter;
+	unsigned long delay_correlation;
+	unsigned long delay_max;
+	dist_t delay_dist;
+};
+
+/* Everything that shapes one direction of traffic.  Each direction sits on
+ * cache lines of its own, so the two never share one.
+ */
+struct alignas(64) direction_config_t{
+	// profiles[0] comes from the top level keys, and applies to frames no
+	// classifier rule matches
+	std::vector<profile_t> profiles;
+	classifier_t classifier;
+	unsigned long delay_max;
 	unsigned long bandwidth;
+	bool repair_checksums;
+	unsigned long reorder;
+	unsigned long reorder_correlation;
+	unsigned long reorder_distance;
+	unsigned long reorder_delay;
+	unsigned long duplicate;
+	unsigned long duplicate_copies;
+	unsigned long duplicate_delay;
+	unsigned long slot_min;
+	unsigned long slot_max;
+	unsigned long slot_packets;
+	unsigned long slot_bytes;
+	// 0 unless a profile keeps per-flow state
+	unsigned long flow_table_size;
+};
+
+// Most interfaces one instance can switch between
+static const int PORTS_MAX = 16;
+
+// Directions are named by the port frames leave through: out[1] is the
+// old a_to_b, out[0] b_to_a
+struct link_config_t{
+	direction_config_t out[PORTS_MAX];
+};
+
+// 802.1Q VLAN IDs are 12 bits
+static const int VLAN_COUNT = 4096;
+
+/* One bridge's settings.  Each bridge has its own, so several can run in
+ * one process.
+ */
+struct config_t{
+	// Indexed by VLAN ID, allocated for configured VLANs.  links[0] comes
+	// from the top level, and carries untagged frames and those of VLANs
+	// without a link of their own.
+	link_config_t *links[VLAN_COUNT];
+	std::vector<int> vlans;
+	// Interface names, set before loading
+	std::vector<std::string> ports;
+	// Interface sent a copy of every frame leaving, or "" for none
+	std::string mirror;
+	// VLAN dropped frames are mirrored on, or 0 not to mirror them
+	int mirror_dropped_vlan;
+};
+
+// Each direction draws from its own generator, as the correlated draws
+// follow on from that direction's previous frame
+struct rand_state_t{
+	unsigned long x, y, z;
+	unsigned long reorder_last;
+	unsigned long delay_last;
+};
+
+/* The changes to a frame's bytes filter() decided on.  impair() makes them
+ * touching nothing but the frame, so any thread can do it.
+ */
+struct impair_t{
+	// Seeds the corruption's own generator; 0 for no corruption
+	unsigned long corrupt_seed;
+	unsigned long corrupt_bytes;
+	// 0 to leave the length alone
+	int truncate_len;
+	bool repair;
 };
 
-bool filter(char *data, int &len);
+struct direction_t;
 
-#ifndef CONFIG_HERE
-extern config_t config;
-#endif
+void rand_seed(rand_state_t &state, unsigned long seed);
+bool filter(direction_t &d, const profile_t &profile, flow_t *flow, 
+			packet_t *&packet, impair_t &work);
+uint64_t filter_segments(direction_t &d, const profile_t &profile, flow_t *flow,
+						 const packet_t *packet, int segments, bool &split);
+void impair(packet_t *packet, const impair_t &work);
+long reorder_offset(direction_t &d);
+int duplicate_count(direction_t &d);
+uint64_t delay_sample(direction_t &d, const profile_t &profile);
+uint64_t slot_interval(direction_t &d);
@@ -0,0 +1,60 @@
+#include <string.h>
+
+#include "flow.h"
+
+static const uint64_t BYTES_01 = 0x0101010101010101ull;
+static const uint64_t BYTES_80 = 0x8080808080808080ull;
+
+
+// Room for at least 'capacity' flows, or none at all if it's 0
+void flow_table_init(flow_table_t &t, size_t capacity){
+	size_t buckets = 1;
+	while (buckets * FLOW_WAYS < capacity) buckets *= 2;
+	flow_bucket_t empty = {0, 0, 0};
+	t.buckets.assign(capacity ? buckets : 0, empty);
+	t.flows.assign(capacity ? buckets * FLOW_WAYS : 0, flow_t());
+	t.mask = buckets - 1;
+}
+
+
+// The flow 'key' belongs to, replacing another flow if it's new
+flow_t *flow_lookup(flow_table_t &t, const class_key_t &key){
+	uint64_t h = key_hash(key);
+	flow_bucket_t &bucket = t.buckets[h & t.mask];
+	flow_t *ways = &t.flows[(h & t.mask) * FLOW_WAYS];
+	// Tags always have the top bit set, so never look empty
+	uint64_t tag = (h >> 56) | 0x80;
+	// Bytes of the bucket's tags equal to this one come out as 0x80, plus
+	// possibly some false positives the key comparison weeds out
+	uint64_t diff = bucket.tags ^ (tag * BYTES_01);
+	uint64_t match = (diff - BYTES_01) & ~diff & BYTES_80;
+	while (match){
+		int way = __builtin_ctzll(match) / 8;
+		if (key_equal(ways[way].key, key)){
+			bucket.referenced |= 1 << way;
+			return &ways[way];
+		}
+		match &= match - 1;
+	}
+	int way;
+	uint64_t empty = ~bucket.tags & BYTES_80;
+	if (empty){
+		way = __builtin_ctzll(empty) / 8;
+	} else {
+		// Give each recently used flow a second chance
+		while (bucket.referenced & (1 << bucket.hand)){
+			bucket.referenced &= ~(1 << bucket.hand);
+			bucket.hand = (bucket.hand + 1) % FLOW_WAYS;
+		}
+		way = bucket.hand;
+		bucket.hand = (bucket.hand + 1) % FLOW_WAYS;
+	}
+	bucket.tags = (bucket.tags & ~(0xffull << (way * 8))) | (tag << (way * 8));
+	bucket.referenced |= 1 << way;
+	flow_t &flow = ways[way];
+	flow.key = key;
+	flow.rate_next = 0;
+	flow.drop_last = 0;
+	flow.packets = 0;
+	return &flow;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+#include "classify.h"
+
+// Impairment state kept for each flow, keyed by the same fields rules
+// match on.  An evicted flow starts again from zeroes.
+struct flow_t{
+	class_key_t key;
+	uint64_t rate_next;
+	unsigned long drop_last;
+	uint32_t packets;
+};
+
+/* The table is set associative: a flow can only live in the FLOW_WAYS slots
+ * of the bucket its hash picks, so a lookup compares at most that many keys.
+ * A full bucket evicts its least recently used flow by the clock algorithm.
+ * All memory is allocated when the table is sized, none per frame.
+ */
+static const int FLOW_WAYS = 8;
+static const size_t FLOW_TABLE_DEFAULT = 1 << 20;
+
+struct flow_bucket_t{
+	uint64_t tags;        // A byte of hash per way, 0 while the way is empty
+	uint8_t referenced;   // A bit per way, set on each hit
+	uint8_t hand;
+};
+
+struct flow_table_t{
+	std::vector<flow_bucket_t> buckets;
+	std::vector<flow_t> flows;
+	size_t mask;
+};
+
+void flow_table_init(flow_table_t &t, size_t capacity);
+flow_t *flow_lookup(flow_table_t &t, const class_key_t &key);
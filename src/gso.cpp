@@ -0,0 +1,133 @@
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+
+#include "gso.h"
+#include "checksum.h"
+
+// TCP flags only the first or last segment keeps
+static const uint8_t TCP_FIN = 0x01;
+static const uint8_t TCP_PSH = 0x08;
+static const uint8_t TCP_CWR = 0x80;
+
+
+static inline uint16_t load16(const char *p){
+	uint16_t v;
+	memcpy(&v, p, 2);
+	return v;
+}
+
+
+static inline void store16(char *p, uint16_t v){
+	memcpy(p, &v, 2);
+}
+
+
+// Where a GSO frame's payload starts, or 0 if it isn't one we can cut up
+static int headers_len(const packet_t *packet){
+	const char *data = packet->data;
+	csum_info_t info;
+	if (!csum_parse(data, packet->len, info)) return 0;
+	int type = packet->vnet.gso_type & ~VNET_GSO_ECN;
+	int end;
+	if (info.proto == IPPROTO_TCP && info.l4 + 20 <= packet->len
+		&& (type == ((info.version == 4) ? VNET_GSO_TCPV4 : VNET_GSO_TCPV6))){
+		end = info.l4 + ((uint8_t)data[info.l4 + 12] >> 4) * 4;
+	} else if (info.proto == IPPROTO_UDP && type == VNET_GSO_UDP_L4){
+		end = info.l4 + 8;
+	} else {
+		return 0;
+	}
+	return (end <= packet->len) ? end : 0;
+}
+
+
+/* Make sense of the virtio-net header a frame was read with, 'shift' bytes
+ * having been put in front of its IP header since, as a VLAN tag.  A GSO
+ * frame we can't cut up is handled as the one frame.
+ */
+void gso_received(packet_t *packet, int shift){
+	vnet_hdr_t &vnet = packet->vnet;
+	if (vnet.flags & VNET_NEEDS_CSUM) vnet.csum_start += shift;
+	if (vnet.gso_type == VNET_GSO_NONE) return;
+	// The kernel's hdr_len is only a hint at how much to copy first
+	vnet.hdr_len = headers_len(packet);
+}
+
+
+/* A copy of segment 'index' of a GSO frame, as a plain frame with its own
+ * lengths, sequence number and checksums.  Anything else is copied whole,
+ * with its checksum filled in.
+ */
+packet_t *gso_segment(const packet_t *packet, int index){
+	const vnet_hdr_t &vnet = packet->vnet;
+	if (gso_segments(packet) == 1){
+		packet_t *copy = packet_alloc(packet->size);
+		memcpy(copy->data, packet->data, packet->len);
+		copy->len = packet->len;
+		copy->vnet = vnet;
+		gso_checksum(copy);
+		return copy;
+	}
+	int header = vnet.hdr_len;
+	int start = header + index * vnet.gso_size;
+	int payload = std::min((int)vnet.gso_size, packet->len - start);
+	int len = header + payload;
+	packet_t *segment = packet_alloc((len <= PACKET_SIZE) ? PACKET_SIZE : packet->size);
+	char *data = segment->data;
+	memcpy(data, packet->data, header);
+	memcpy(data + header, packet->data + start, payload);
+	segment->len = len;
+
+	// gso_received() found the headers sound
+	csum_info_t info;
+	csum_parse(data, len, info);
+	info.l3_end = len;
+	if (info.version == 4){
+		store16(&data[info.l3 + 2], htons(len - info.l3));
+		store16(&data[info.l3 + 4], htons(ntohs(load16(&data[info.l3 + 4])) + index));
+		info.l3_dirty = true;
+	} else {
+		store16(&data[info.l3 + 4], htons(len - info.l4));
+	}
+	if (info.proto == IPPROTO_TCP){
+		uint32_t seq;
+		memcpy(&seq, &data[info.l4 + 4], 4);
+		seq = htonl(ntohl(seq) + index * vnet.gso_size);
+		memcpy(&data[info.l4 + 4], &seq, 4);
+		uint8_t flags = data[info.l4 + 13];
+		if (index) flags &= ~TCP_CWR;
+		if (start + payload < packet->len) flags &= ~(TCP_FIN | TCP_PSH);
+		data[info.l4 + 13] = flags;
+		info.l4_csum = info.l4 + 16;
+	} else {
+		store16(&data[info.l4 + 4], htons(len - info.l4));
+		info.l4_csum = info.l4 + 6;
+	}
+	// The checksum the frame came with only covers the pseudo header
+	info.l4_dirty = true;
+	csum_finish(data, info);
+	return segment;
+}
+
+
+/* Fill in a checksum the kernel left for the sender to, so the frame's
+ * bytes can be changed and it can go where there's no kernel to do it.
+ * Nor is the frame then said to be good without checking.
+ */
+void gso_checksum(packet_t *packet){
+	vnet_hdr_t &vnet = packet->vnet;
+	if (vnet.gso_type != VNET_GSO_NONE) return;
+	vnet.flags &= ~VNET_DATA_VALID;
+	if (!(vnet.flags & VNET_NEEDS_CSUM)) return;
+	int start = vnet.csum_start;
+	if (start + vnet.csum_offset + 2 > packet->len) return;
+	// The field already holds the sum of the pseudo header
+	uint16_t check = ~csum_fold(csum_partial(&packet->data[start],
+											 packet->len - start, 0));
+	if (!check) check = 0xffff;
+	store16(&packet->data[start + vnet.csum_offset], check);
+	vnet.flags &= ~VNET_NEEDS_CSUM;
+}
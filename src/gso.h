@@ -0,0 +1,26 @@
+#pragma once
+
+#include "packet.h"
+
+/* GSO frames: a TCP or UDP datagram of up to 64KB that the kernel hands
+ * over whole, with its virtio-net header saying how to cut it into
+ * segments of gso_size bytes of payload, each behind a copy of its first
+ * hdr_len bytes of headers.  It's cut up on the wire, after the hub, unless
+ * the hub needs the segments themselves.
+ */
+
+void gso_received(packet_t *packet, int shift);
+packet_t *gso_segment(const packet_t *packet, int index);
+void gso_checksum(packet_t *packet);
+
+// The frames a GSO frame stands for on the wire; 1 for anything else
+static inline int gso_segments(const packet_t *packet){
+	const vnet_hdr_t &vnet = packet->vnet;
+	if (!vnet.gso_size || !vnet.hdr_len) return 1;
+	return (packet->len - vnet.hdr_len + vnet.gso_size - 1) / vnet.gso_size;
+}
+
+// Bytes on the wire, each segment with headers of its own
+static inline long gso_wire_len(const packet_t *packet){
+	return packet->len + (long)(gso_segments(packet) - 1) * packet->vnet.hdr_len;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <new>
+#include <algorithm>
+
+#include "link.h"
+
+
+static void direction_reset(direction_t &d, direction_config_t &config, 
+							unsigned long seed, uint64_t now){
+	d.config = &config;
+	d.queue_time = {0, 0};
+	d.slot.opens = 0;
+	reorder_reset(d, now);
+	flow_table_init(d.flows, config.flow_table_size);
+	if (!d.rand.x) rand_seed(d.rand, seed);
+}
+
+
+// A link whose VLAN is gone from the config loses what it had queued
+static void direction_drain(direction_t &d, uint64_t now){
+	reorder_reset(d, now);
+	while (!d.queue.empty()){
+		packet_unref(d.queue.front());
+		d.queue.pop_front();
+		++d.stats.dropped;
+	}
+	flow_table_init(d.flows, 0);
+}
+
+
+static direction_t *direction_new(int vlan){
+	void *memory;
+	// Directions are cache line aligned, which plain new doesn't promise
+	if (posix_memalign(&memory, 64, sizeof(direction_t))){
+		fprintf(stderr, "Error: Out of memory for VLAN %i\n", vlan);
+		abort();
+	}
+	return new (memory) direction_t();
+}
+
+
+// Point every VLAN ID at its link after the config has been (re)loaded
+void link_map_reset(link_map_t &m, config_t &config, uint64_t now){
+	std::vector<int> vlans(1, 0);
+	vlans.insert(vlans.end(), config.vlans.begin(), config.vlans.end());
+	int ports = config.ports.size();
+	for (link_t *link : m.active){
+		if (std::find(vlans.begin(), vlans.end(), link->vlan) == vlans.end()){
+			for (int port=0; port<ports; ++port) direction_drain(*link->out[port], now);
+		}
+	}
+	m.active.clear();
+	for (int vlan : vlans){
+		link_t *&link = m.allocated[vlan];
+		if (!link){
+			link = new link_t();
+			link->vlan = vlan;
+		}
+		for (int port=0; port<ports; ++port){
+			if (!link->out[port]) link->out[port] = direction_new(vlan);
+			direction_reset(*link->out[port], config.links[vlan]->out[port], 
+							(m.seed * VLAN_COUNT + vlan) * PORTS_MAX + port + 1, now);
+		}
+		m.active.push_back(link);
+	}
+	for (int vlan=0; vlan<VLAN_COUNT; ++vlan) m.by_vlan[vlan] = m.allocated[0];
+	for (link_t *link : m.active) m.by_vlan[link->vlan] = link;
+}
+
+
+static void print_direction(const char *name, int vlan, const char *port, 
+							const direction_t &d){
+	const direction_stats_t &s = d.stats;
+	printf("%s%svlan %i to %s: received %lu dropped %lu sent %lu (%lu bytes) "
+		   "queued %lu\n", name, *name ? " " : "", vlan, port, s.received, s.dropped, s.sent, 
+		   s.sent_bytes, d.queue.size());
+}
+
+
+// The stats of the directions to 'ports'
+void link_map_print_stats(const link_map_t &m, const config_t &config, 
+						  const char *name, const bool *ports){
+	for (const link_t *link : m.active){
+		for (size_t port=0; port<config.ports.size(); ++port){
+			if (!ports[port]) continue;
+			print_direction(name, link->vlan, config.ports[port].c_str(), 
+							*link->out[port]);
+		}
+	}
+	fflush(stdout);
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <stdint.h>
+
+#include <vector>
+
+#include "filter.h"
+#include "direction.h"
+#include "fdb.h"
+
+// One emulated link or LAN: a direction for frames leaving each port,
+// allocated for the ports in use
+struct link_t{
+	int vlan;
+	direction_t *out[PORTS_MAX];
+};
+
+/* Every VLAN ID points at a link, so finding a frame's link is one indexed
+ * load.  IDs without a link of their own share links[0].  Links are only
+ * allocated for configured VLANs, and kept for reuse if a reload drops them.
+ * MAC addresses are learnt per VLAN, as an 802.1Q bridge does.
+ */
+struct link_map_t{
+	link_t *by_vlan[VLAN_COUNT];
+	link_t *allocated[VLAN_COUNT];
+	std::vector<link_t *> active;
+	// Only switches of more than two ports need one
+	fdb_t *fdb;
+	// Keeps each bridge's random draws apart
+	unsigned long seed;
+};
+
+void link_map_reset(link_map_t &m, config_t &config, uint64_t now);
+void link_map_print_stats(const link_map_t &m, const config_t &config, 
+						  const char *name, const bool *ports);
+
+// The VLAN ID of a tagged frame, or 0 if it's untagged
+static inline int frame_vlan(const char *data, int len){
+	const uint8_t *p = (const uint8_t *)data;
+	if (len < 16) return 0;
+	uint16_t tpid = (p[12] << 8) | p[13];
+	if (tpid != 0x8100 && tpid != 0x88a8) return 0;
+	return ((p[14] << 8) | p[15]) & 0xfff;
+}
@@ -1,71 +1,66 @@
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <signal.h>
 #include <errno.h>
 #include <unistd.h>
-#include <arpa/inet.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
-#include <sys/ioctl.h>
-#include <net/if.h>
-#include <linux/if_packet.h>
-#include <sys/socket.h>
-#include <linux/if_ether.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
 
-#include <deque>
-#include <string>
+#include <new>
+#include <algorithm>
+#include <vector>
 
 #include "filter.h"
 #include "config.h"
+#include "queue.h"
+#include "bridge.h"
+#include "ring.h"
+#include "steal.h"
+#include "memory.h"
+#include "uring.h"
+#include "shm.h"
 
 
-typedef std::deque<std::string> queue_t;
-static bool reload_config = true;
+// Commands the main thread sends workers.  A reload comes with an array of
+// the worker's bridges' configs, newly loaded, and goes back with the old.
+static const uint64_t CMD_RELOAD = 1;
+static const uint64_t CMD_STATS = 2;
+
+// How often the main thread tries again to hand over a reload
+static const long RELOAD_RETRY_NS = 10 * 1000 * 1000;
 
 
 void usage(){
-	fprintf(stderr, "Usage: interface_a interface_b\n");
+	fprintf(stderr, "Usage: interface_a interface_b [interface ...]\n");
+	fprintf(stderr, "       -d  (run the config's \"bridges\")\n");
 	fprintf(stderr, "This command must be run as root\n");
 	_exit(1);
 }
 
 
-typedef int socket_t;
-typedef struct mac_t { char address[6]; } mac_t;
-
+// Event keys: the bridge and port of a socket, or one of these or
+// URING_SENT
+static const uint64_t KEY_TIMER = ~0ull;
+static const uint64_t KEY_WAKE = ~0ull - 1;
 
-void setup_iface(socket_t sock, int iface){
-	// Bind socket to interface
-	struct sockaddr_ll sll;
-	sll.sll_family = AF_PACKET;
-	sll.sll_ifindex = iface;
-	sll.sll_protocol = htons(ETH_P_ALL);
-	bind(sock, (struct sockaddr *)&sll, sizeof(sll)); 
-	// Set promiscuous mode
-	struct packet_mreq mr;
-	memset(&mr, 0, sizeof (mr));
-	mr.mr_ifindex = iface;
-	mr.mr_type = PACKET_MR_PROMISC;
-	setsockopt(sock, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr));
+static inline uint64_t port_key(size_t bridge, int port){
+	return (bridge << 8) | port;
 }
 
 
-int get_raw_iface(const char *iface){
-	struct ifreq ifr;
-	if (strlen(iface) > (IFNAMSIZ - 1)) usage();
-	socket_t sock = socket(PF_PACKET, SOCK_RAW, ETH_P_ALL);
-	// Look up the interface id for eth1 
-	strncpy((char *) ifr.ifr_name, iface, IFNAMSIZ);
-	ioctl(sock, SIOCGIFINDEX, &ifr);
-	setup_iface(sock, ifr.ifr_ifindex);
-	return sock;
-};
-
-
-void epolladd(int poll, socket_t sock, uint32_t data=0, bool add=true){
+void epolladd(int poll, int fd, uint64_t key, uint32_t events=EPOLLIN, 
+			  bool add=true){
 	epoll_event ev;
-	ev.events = EPOLLIN | data;
-	ev.data.fd = sock;
-	int rv = epoll_ctl(poll, (add) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, sock, &ev);
+	ev.events = events;
+	ev.data.u64 = key;
+	int rv = epoll_ctl(poll, (add) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
     if (rv < 0){
 		fprintf(stderr, "Epoll add failed: %s\n", strerror(errno));
         abort();
@@ -73,127 +68,565 @@ void epolladd(int poll, socket_t sock, uint32_t data=0, bool add=true){
 }
 
 
-void add_reader(int poll, socket_t sock){
-	epolladd(poll, sock);
+void listen_write(int poll, port_t &port, uint64_t key, bool expect_write){
+	if (expect_write == port.writing) return;
+	port.writing = expect_write;
+	uint32_t events = (port.reading ? (uint32_t)EPOLLIN : 0) 
+		| (expect_write ? (uint32_t)EPOLLOUT : 0);
+	epolladd(poll, port.sock, key, events, false);
 }
 
 
-void listen_write(int poll, socket_t sock, bool expect_write){
-	if (expect_write) epolladd(poll, sock, EPOLLOUT, false);
-	else epolladd(poll, sock, 0, false);
+// Wake epoll at 'when' (CLOCK_MONOTONIC ns), or never if it's 0
+void arm_timer(int timer, uint64_t when){
+	itimerspec spec = {{0, 0}, {0, 0}};
+	if (when) spec.it_value = ns_timespec(when);
+	timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, NULL);
 }
 
 
-mac_t get_mac(socket_t sock, const char* iface){
-	ifreq ifr;
-	strncpy((char *) ifr.ifr_name, iface, IFNAMSIZ);
-	
-	if (ioctl(sock, SIOCGIFHWADDR, &ifr) != 0){
-		printf("Error getting H/W address of iface: %s\n", strerror(errno));
-		abort();
+// Sleeping, this many wakes in a row bringing frames, each within the idle
+// period of the last, start a worker spinning again
+static const int SPIN_WAKES = 2;
+
+/* Adaptive polling: spin while frames keep coming, and go back to sleeping
+ * in epoll_wait() once none have for 'idle_ns'.  A lone frame doesn't start
+ * it spinning again, so sparse traffic can't make it flap.
+ */
+struct polling_t{
+	bool spinning;
+	// 0 to keep to 'spinning' for good
+	uint64_t idle_ns;
+	uint64_t last_traffic;
+	int traffic_wakes;
+	uint64_t spins;
+	// Switches from spinning to sleeping, and back
+	uint64_t sleeps;
+	uint64_t wakes;
+};
+
+
+static void polling_update(polling_t &p, bool traffic, uint64_t now){
+	if (p.spinning) ++p.spins;
+	if (!p.idle_ns) return;
+	if (p.spinning){
+		if (traffic) p.last_traffic = now;
+		else if (now - p.last_traffic > p.idle_ns){
+			p.spinning = false;
+			p.traffic_wakes = 0;
+			++p.sleeps;
+		}
+		return;
+	}
+	if (!traffic) return;
+	bool flowing = now - p.last_traffic <= p.idle_ns;
+	p.traffic_wakes = flowing ? p.traffic_wakes + 1 : 1;
+	p.last_traffic = now;
+	if (p.traffic_wakes >= SPIN_WAKES){
+		p.spinning = true;
+		++p.wakes;
 	}
-	mac_t result;
-	memcpy(result.address, ifr.ifr_hwaddr.sa_data, 6);
-	return result;
 }
 
 
-void signal_reload_handler(int signum) {
-	printf("Caught signal %d\n",signum);
-	reload_config = true;
-	return;
-}
+/* A thread running a share of the bridges.  They all wait in one epoll set
+ * or io_uring on one timer, and take their buffers from the thread's own
+ * packet pool.
+ * Workers share nothing with each other, or with the main thread but their
+ * command rings.
+ */
+struct worker_t{
+	pthread_t thread;
+	// From the main thread, and back to it with configs done with
+	ring_t *commands;
+	ring_t *spent;
+	// Commands in the ring the worker is yet to take; each is there at most
+	// once, so the ring never fills
+	uint64_t pending;
+	std::vector<bridge_t *> bridges;
+	// Each bridge's interfaces, and place in the config's "bridges" or -1 for
+	// the top level, for the main thread to load its config with
+	std::vector<std::vector<std::string> > ports;
+	std::vector<int> indices;
+	// Poked by the main thread when a signal comes in, and by other workers
+	// when there's work to steal or stolen work is done
+	int wake;
+	// Frames waiting to be impaired, if workers share the work
+	steal_queue_t *work;
+	// Set while waiting for events with nothing to do
+	int idle;
+	polling_t polling;
+	// Fault everything in before starting
+	bool realtime;
+	// NUMA node of the first bridge's first interface, or -1
+	int node;
+	// Use an io_uring, and have the kernel poll its submission queue
+	bool uring;
+	bool sqpoll;
+	// Longest spent handling one round of events, and longest a frame was
+	// held past its time, in ns
+	uint64_t worst_pass;
+	uint64_t worst_late;
+};
 
+static worker_t *workers;
+static size_t n_workers;
 
-int cmp_times (const timespec &a, const timespec &b) {
-	if (a.tv_sec == b.tv_sec){
-		return (a.tv_nsec == b.tv_nsec) ? 0 : ((a.tv_nsec > b.tv_nsec) ? 1 : -1);
+
+// Take a batch of another worker's frames, if any of them has some
+static bool steal_from_others(worker_t &w){
+	size_t self = &w - workers;
+	for (size_t i=1; i<n_workers; ++i){
+		worker_t &other = workers[(self + i) % n_workers];
+		if (!steal_work(*other.work, STEAL_BATCH)) continue;
+		// Its owner delivers them
+		uint64_t one = 1;
+		write(other.wake, &one, sizeof(one));
+		return true;
 	}
-	return (a.tv_sec == b.tv_sec) ? 0 : ((a.tv_sec > b.tv_sec) ? 1 : -1);
- }
+	return false;
+}
 
-static const size_t NS_PER_S = 1000000000;
 
-int main(int argc, const char ** argv){
-	if (argc != 3) usage();
-	if (geteuid()) usage();
+// Returns false if every other worker is busy
+static bool wake_idle_worker(worker_t &w){
+	for (size_t i=0; i<n_workers; ++i){
+		worker_t &other = workers[i];
+		if (&other == &w || !__atomic_exchange_n(&other.idle, 0, __ATOMIC_SEQ_CST)){
+			continue;
+		}
+		uint64_t one = 1;
+		write(other.wake, &one, sizeof(one));
+		return true;
+	}
+	return false;
+}
 
-	socket_t write_sock = socket(PF_PACKET, SOCK_RAW, ETH_P_ALL);
 
-	queue_t a_queue;
-	queue_t b_queue;
+// What a realtime worker has faulted in before it starts, with this much
+// more in buffers bigger than the usual
+static const int RT_PACKETS = 8192;
+static const size_t RT_LARGE_BYTES = 64 << 20;
+static const size_t RT_HEAP_BYTES = 16 << 20;
+static const size_t RT_STACK_BYTES = 256 << 10;
+static const size_t PAGE_BYTES = 4096;
 
-	timespec a_queue_time = {0, 0};
-	timespec b_queue_time = {0, 0};
 
-	socket_t a_sock = get_raw_iface(argv[1]);
-	mac_t a_mac = get_mac(a_sock, argv[1]);
-	socket_t b_sock = get_raw_iface(argv[2]);
-	mac_t b_mac = get_mac(b_sock, argv[2]);
-	int poll = epoll_create(2);
+static void __attribute__((noinline)) prefault_stack(){
+	volatile char stack[RT_STACK_BYTES];
+	for (size_t i=0; i<RT_STACK_BYTES; i+=PAGE_BYTES) stack[i] = 0;
+	(void)stack[0];
+}
 
-	add_reader(poll, a_sock);
-	add_reader(poll, b_sock);
 
-	signal(SIGHUP, signal_reload_handler);
+/* Fault in what the worker's loop will touch: its packet pool, heap for
+ * queues to grow into, and its stack.  Locked memory that's never given
+ * back then can't fault again.
+ */
+static void prefault(int packet_size, int ring_size){
+	packet_pool_reserve(RT_PACKETS);
+	if (packet_size > PACKET_SIZE){
+		packet_pool_reserve(RT_LARGE_BYTES / packet_size, packet_size);
+	}
+	// An io_uring's buffers have room for the kernel's headers too
+	if (ring_size) packet_pool_reserve(RT_LARGE_BYTES / ring_size, ring_size);
+	volatile char *heap = (volatile char *)malloc(RT_HEAP_BYTES);
+	if (heap){
+		for (size_t i=0; i<RT_HEAP_BYTES; i+=PAGE_BYTES) heap[i] = 0;
+		free((void *)heap);
+	}
+	prefault_stack();
+}
 
-	char in_data[1600];
-	epoll_event events[4];
-	while (1){
-		
-		if (reload_config){
-			load_config();	
-			reload_config = false;
-			a_queue_time = {0, 0};
-			b_queue_time = {0, 0};
+
+void *run_worker(void *arg){
+	worker_t &w = *(worker_t *)arg;
+	memory_prefer_node(w.node);
+	size_t n_bridges = w.bridges.size();
+	// The ring receives for the packet sockets, into buffers big enough
+	// for any of them
+	int packet_size = PACKET_SIZE;
+	bool gso = false;
+	for (bridge_t *bridge : w.bridges){
+		for (int port=0; port<bridge->n_ports; ++port){
+			const port_t &p = bridge->ports[port];
+			packet_size = std::max(packet_size, p.packet_size);
+			if (!p.tap && !p.shm) gso = p.gso;
+		}
+	}
+	if (w.realtime){
+		prefault(packet_size, w.uring ? uring_buffer_size(packet_size, gso) : 0);
+	}
+	uring_t *uring = w.uring ? uring_open(w.sqpoll, w.node, packet_size, gso) : NULL;
+	int poll = epoll_create1(0);
+	size_t n_fds = 2;
+	for (size_t b=0; b<n_bridges; ++b){
+		bridge_t &bridge = *w.bridges[b];
+		for (int port=0; port<bridge.n_ports; ++port){
+			port_t &p = bridge.ports[port];
+			// TAP devices and shared memory ports are polled and read directly
+			bool direct = p.tap || p.shm;
+			p.uring = direct ? NULL : uring;
+			if (!uring){
+				epolladd(poll, p.sock, port_key(b, port), 
+						 p.reading ? (uint32_t)EPOLLIN : 0);
+			} else if (p.reading && direct){
+				uring_poll(*uring, p.sock, port_key(b, port));
+			} else if (p.reading){
+				uring_recv(*uring, p.sock, port_key(b, port));
+			}
 		}
+		n_fds += bridge.n_ports;
+	}
+	int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (uring){
+		uring_poll(*uring, timer, KEY_TIMER);
+		uring_poll(*uring, w.wake, KEY_WAKE);
+	} else {
+		epolladd(poll, timer, KEY_TIMER);
+		epolladd(poll, w.wake, KEY_WAKE);
+	}
+	uint64_t timer_at = 0;
+	bool reload = false;
+	config_t *fresh = NULL;
+	steal_queue_t *queue = w.work;
+	uint64_t pass_start = 0;
+
+	std::vector<epoll_event> events(n_fds);
+	std::vector<uring_event_t> completions(uring ? URING_EVENTS : 0);
+	while (1){
 		timespec this_tick;
 		clock_gettime(CLOCK_MONOTONIC, &this_tick);
-		bool write_to_a = (!a_queue.empty()) && (cmp_times(this_tick, a_queue_time) > 0);
-		bool write_to_b = (!b_queue.empty()) && (cmp_times(this_tick, b_queue_time) > 0);
-		
-		listen_write(poll, a_sock, write_to_a);
-		listen_write(poll, b_sock, write_to_b);
-
-		int count = epoll_wait(poll, events, 4, -1);
-		if (count == 0) fprintf(stderr, "Got no events?!\n");
-		for (int i=0; i< count; ++i){
-			epoll_event &event = events[i];
-			socket_t sock = event.data.fd;
-			if (event.events & EPOLLOUT){
-				queue_t &queue = (sock == a_sock) ? a_queue : b_queue;
-				std::string &data = *(queue.begin());
-				int len = write(sock, data.c_str(), data.size());
-				if (len != data.size()){
-					fprintf(stderr, "Not all bytes written: %i,  %lu\n", 
-						   len, data.size());
-				}
-				queue.pop_front();
-				if (config.bandwidth){
-					timespec &target_sleep = ((sock == a_sock) 
-											  ? a_queue_time 
-											  : b_queue_time);
-					size_t ns_to_sleep = config.bandwidth * len;
-					target_sleep = this_tick;
-					target_sleep.tv_sec += ns_to_sleep / NS_PER_S;
-					target_sleep.tv_nsec += ns_to_sleep % NS_PER_S;
-				}
-			}else{
-				queue_t &queue = (sock == a_sock) ? b_queue : a_queue;
-				mac_t &mac = (sock == a_sock) ? a_mac : b_mac;
-				int len = read(sock, in_data, 1600);
-				if (len < 0){
-					printf("Read failed: %s from %lu\n", strerror(errno), sock);
-					abort();
+		uint64_t now = timespec_ns(this_tick);
+
+		bool print_stats = false;
+		message_t message;
+		while (ring_pop(*w.commands, message)){
+			__atomic_fetch_and(&w.pending, ~message.command, __ATOMIC_RELEASE);
+			if (message.command == CMD_RELOAD){
+				fresh = (config_t *)message.data;
+				reload = true;
+			} else if (message.command == CMD_STATS){
+				print_stats = true;
+			}
+		}
+		if (queue) steal_commit(*queue, now);
+		if (reload){
+			reload = false;
+			// Resetting the bridges isn't part of the loop's latency
+			pass_start = 0;
+			// Frames in flight point at the config about to go
+			if (queue) steal_drain(*queue, now);
+			for (size_t b=0; b<n_bridges; ++b){
+				std::swap(w.bridges[b]->config, fresh[b]);
+				bridge_reset(*w.bridges[b], now);
+			}
+			message_t old = {CMD_RELOAD, fresh};
+			ring_push(*w.spent, old);
+			fresh = NULL;
+		}
+		if (print_stats){
+			for (bridge_t *bridge : w.bridges) bridge_print_stats(*bridge);
+			const polling_t &p = w.polling;
+			printf("worker %zu: spins %lu sleeps %lu wakes %lu worst pass %luus "
+				   "worst late %luus\n", &w - workers, p.spins, p.sleeps, p.wakes, 
+				   w.worst_pass / NS_PER_US, w.worst_late / NS_PER_US);
+			fflush(stdout);
+		}
+		// Sleep no later than the next paced or held-back frame is due
+		uint64_t wake = 0;
+		for (size_t b=0; b<n_bridges; ++b){
+			bridge_t &bridge = *w.bridges[b];
+			bool writable[PORTS_MAX] = {false};
+			wake = earliest(wake, bridge_ready(bridge, this_tick, now, writable));
+			for (int port=0; port<bridge.n_ports; ++port){
+				// A ring sends straight away, once the last sends are done,
+				// and a shared memory port's peer wakes us when it has room
+				port_t &p = bridge.ports[port];
+				if (!uring && !p.shm){
+					listen_write(poll, p, port_key(b, port), writable[port]);
+				} else if (writable[port] && !p.in_flight){
+					bridge_send(bridge, port, this_tick, now);
 				}
-				if (strncmp(in_data, mac.address, 6) 
-					&& strncmp(&in_data[6], mac.address, 6)){
-					if (filter(in_data, len)){
-						queue.emplace_back(in_data, len);
-					}
+			}
+		}
+
+		// Spinning workers see the time come round themselves
+		if (!w.polling.spinning && wake != timer_at){
+			arm_timer(timer, wake);
+			timer_at = wake;
+		}
+
+		// With frames to impair, only check for events; with nothing to do,
+		// help another worker before sleeping
+		int timeout = -1;
+		if (queue){
+			if (steal_backlog(*queue) || steal_from_others(w)) timeout = 0;
+			else {
+				__atomic_store_n(&w.idle, 1, __ATOMIC_SEQ_CST);
+				// Work published before 'idle' was set didn't wake us
+				if (steal_from_others(w)) timeout = 0;
+			}
+		}
+		if (w.polling.spinning) timeout = 0;
+		for (size_t b=0; b<n_bridges && timeout; ++b){
+			if (!bridge_idle(*w.bridges[b])) timeout = 0;
+		}
+		if (pass_start){
+			clock_gettime(CLOCK_MONOTONIC, &this_tick);
+			w.worst_pass = std::max(w.worst_pass, timespec_ns(this_tick) - pass_start);
+		}
+		int count = uring 
+			? uring_wait(*uring, timeout, completions.data(), completions.size())
+			: epoll_wait(poll, events.data(), events.size(), timeout);
+		if (queue) __atomic_store_n(&w.idle, 0, __ATOMIC_SEQ_CST);
+		if (count == 0 && timeout) fprintf(stderr, "Got no events?!\n");
+		clock_gettime(CLOCK_MONOTONIC, &this_tick);
+		now = timespec_ns(this_tick);
+		pass_start = now;
+		if (wake && now > wake) w.worst_late = std::max(w.worst_late, now - wake);
+		bool traffic = false;
+		for (int i=0; i< count; ++i){
+			uint64_t key = uring ? completions[i].key : events[i].data.u64;
+			if (key == URING_SENT){
+				traffic = true;
+				continue;
+			}
+			if (key == KEY_TIMER || key == KEY_WAKE){
+				uint64_t expirations;
+				read((key == KEY_TIMER) ? timer : w.wake, &expirations, 
+					 sizeof(expirations));
+				if (key == KEY_TIMER) timer_at = 0;
+				continue;
+			}
+			bridge_t &bridge = *w.bridges[key >> 8];
+			int port = key & 0xff;
+			if (uring){
+				packet_t *packet = completions[i].packet;
+				if (packet) bridge_input(bridge, port, packet, now);
+				// A poll only says when more come in, so read them all
+				else if (bridge.ports[port].tap || bridge.ports[port].shm){
+					while (bridge_receive(bridge, port, now));
 				}
+			} else {
+				uint32_t flags = events[i].events;
+				if (flags & EPOLLOUT) bridge_send(bridge, port, this_tick, now);
+				if (flags & EPOLLIN) bridge_receive(bridge, port, now);
 			}
+			traffic = true;
 		} 
+		for (bridge_t *bridge : w.bridges){
+			if (bridge_poll(*bridge, now)) traffic = true;
+		}
+		polling_update(w.polling, traffic, now);
+		if (!queue) continue;
+		// Hand a backlog to an idle worker, or work through it
+		if (!count) steal_work(*queue, STEAL_SLOTS);
+		else if (steal_backlog(*queue) >= STEAL_BATCH && !wake_idle_worker(w)){
+			steal_work(*queue, STEAL_BATCH);
+		}
+	}
+	return NULL;
+}
+
+
+static void add_bridge(size_t &next, bridge_t *bridge, int index){
+	worker_t &w = workers[next++ % n_workers];
+	w.bridges.push_back(bridge);
+	w.ports.push_back(bridge->config.ports);
+	w.indices.push_back(index);
+}
+
+
+// Send a command the worker doesn't have waiting already
+static bool send_command(worker_t &w, uint64_t command, void *data){
+	if (__atomic_fetch_or(&w.pending, command, __ATOMIC_ACQUIRE) & command){
+		return false;
+	}
+	message_t message = {command, data};
+	ring_push(*w.commands, message);
+	uint64_t one = 1;
+	write(w.wake, &one, sizeof(one));
+	return true;
+}
+
+
+/* Hand the workers owed a reload their bridges' configs, all loaded from
+ * one reading of the file.  One yet to take the last it was sent stays
+ * owed.  Returns whether any is.
+ */
+static bool send_reloads(std::vector<bool> &owed){
+	message_t message;
+	for (size_t i=0; i<n_workers; ++i){
+		while (ring_pop(*workers[i].spent, message)){
+			config_t *old = (config_t *)message.data;
+			for (size_t b=0; b<workers[i].bridges.size(); ++b) free_config(old[b]);
+			delete[] old;
+		}
+	}
+	std::vector<config_t *> fresh(n_workers, (config_t *)NULL);
+	std::vector<config_t *> configs;
+	std::vector<int> indices;
+	bool owing = false;
+	for (size_t i=0; i<n_workers; ++i){
+		worker_t &w = workers[i];
+		if (!owed[i]) continue;
+		if (__atomic_load_n(&w.pending, __ATOMIC_ACQUIRE) & CMD_RELOAD){
+			owing = true;
+			continue;
+		}
+		fresh[i] = new config_t[w.bridges.size()]();
+		for (size_t b=0; b<w.bridges.size(); ++b){
+			fresh[i][b].ports = w.ports[b];
+			configs.push_back(&fresh[i][b]);
+			indices.push_back(w.indices[b]);
+		}
+	}
+	if (!configs.empty()) load_config(configs.data(), indices.data(), configs.size());
+	for (size_t i=0; i<n_workers; ++i){
+		if (!fresh[i]) continue;
+		send_command(workers[i], CMD_RELOAD, fresh[i]);
+		owed[i] = false;
+	}
+	return owing;
+}
+
+
+int main(int argc, const char ** argv){
+	bool daemon = (argc == 2 && !strcmp(argv[1], "-d"));
+	if (!daemon && (argc < 3 || argc > PORTS_MAX + 1)) usage();
+	if (geteuid()) usage();
+
+	// Signals go to the main thread alone, which passes them on
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	startup_t startup;
+	std::vector<int> indices;
+	if (!daemon){
+		// Frames read on one port are written to the others by the link of
+		// the frame's VLAN
+		bridge_spec_t spec;
+		spec.interfaces.assign(argv + 1, argv + argc);
+		startup.bridges.push_back(spec);
+		indices.push_back(-1);
+	}
+	load_startup(startup, daemon);
+	if (startup.bridges.empty()){
+		fprintf(stderr, "Error: No bridges in the config\n");
+		abort();
+	}
+	size_t n_units = 0;
+	size_t min_workers = 1;
+	for (size_t b=0; b<startup.bridges.size(); ++b){
+		if (daemon) indices.push_back(b);
+		n_units += startup.bridges[b].split ? 2 : startup.bridges[b].queues;
+		// The halves of a split bridge can't share a thread
+		if (startup.bridges[b].split) min_workers = 2;
+	}
+	n_workers = startup.workers;
+	if (!n_workers) n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	n_workers = std::max(min_workers, std::min(n_workers, n_units));
+	if ((startup.busy_poll || startup.spin_idle) && startup.cpus.empty()){
+		fprintf(stderr, "Warning: Spinning without cpus leaves workers free "
+				"to move between CPUs\n");
+	}
+
+	memory_use_hugepages(startup.hugepages);
+
+	// A split bridge's halves, and a bridge's queues, go to neighbouring
+	// workers
+	workers = new worker_t[n_workers]();
+	size_t next = 0;
+	for (size_t b=0; b<startup.bridges.size(); ++b){
+		const bridge_spec_t &spec = startup.bridges[b];
+		for (int q=0; q<spec.queues; ++q){
+			unsigned long seed = 2 * (b + q * startup.bridges.size());
+			bridge_t *bridge = new bridge_t();
+			bridge_open(*bridge, spec.name, spec.interfaces, seed, spec.queues,
+						startup.gso);
+			if (startup.busy_poll) bridge_busy_poll(*bridge, startup.busy_poll);
+			bridge_bypass(*bridge, startup.qdisc_bypass, startup.ignore_outgoing);
+			add_bridge(next, bridge, indices[b]);
+			if (spec.split) add_bridge(next, bridge_split(*bridge, seed + 1), indices[b]);
+		}
+	}
+	for (size_t i=0; i<n_workers; ++i){
+		worker_t &w = workers[i];
+		// Its memory is local to the interface it reads first
+		w.node = memory_iface_node(w.bridges[0]->config.ports[0].c_str());
+		w.commands = new (memory_alloc(sizeof(ring_t), w.node)) ring_t();
+		w.spent = new (memory_alloc(sizeof(ring_t), w.node)) ring_t();
+		w.wake = eventfd(0, EFD_NONBLOCK);
+		w.polling.spinning = startup.busy_poll || startup.spin_idle;
+		w.polling.idle_ns = startup.spin_idle * NS_PER_US;
+		w.realtime = startup.realtime;
+		w.uring = startup.uring;
+		w.sqpoll = startup.sqpoll;
+		if (startup.steal){
+			w.work = steal_queue_new(w.node);
+			for (bridge_t *bridge : w.bridges) bridge->work = w.work;
+		}
+	}
+	if (startup.realtime){
+		// Memory freed goes back to malloc's arenas, never to the kernel, so
+		// once faulted in and locked it stays that way
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_MMAP_MAX, 0);
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0){
+			fprintf(stderr, "Error: Can't lock memory: %s\n", strerror(errno));
+			abort();
+		}
+	}
+	shm_serve();
+	// Workers start with their configs waiting
+	std::vector<bool> owed(n_workers, true);
+	send_reloads(owed);
+	// Every worker's queue is there before any worker looks for one
+	for (size_t i=0; i<n_workers; ++i){
+		worker_t &w = workers[i];
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (!startup.cpus.empty()){
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(startup.cpus[i % startup.cpus.size()], &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+		if (startup.realtime){
+			sched_param param;
+			memset(&param, 0, sizeof(param));
+			param.sched_priority = startup.realtime;
+			pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+			pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+			pthread_attr_setschedparam(&attr, &param);
+		}
+		int error = pthread_create(&w.thread, &attr, run_worker, &w);
+		if (error){
+			fprintf(stderr, "Error: Can't start worker %zu: %s\n", i, 
+					strerror(error));
+			abort();
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	// A signal sent again before the workers see it is seen once; a reload
+	// a worker can't take yet is tried again until it can
+	bool owing = false;
+	while (1){
+		timespec retry = {0, RELOAD_RETRY_NS};
+		int signum = sigtimedwait(&signals, NULL, owing ? &retry : NULL);
+		if (signum == SIGHUP){
+			printf("Caught signal %d\n",signum);
+			fflush(stdout);
+			owed.assign(n_workers, true);
+		} else if (signum == SIGUSR1){
+			for (size_t i=0; i<n_workers; ++i) send_command(workers[i], CMD_STATS, NULL);
+		}
+		owing = send_reloads(owed);
 	}
 	return 0;
 }
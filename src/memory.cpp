@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "memory.h"
+
+// From numaif.h, which needs libnuma's headers
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+// Set once at startup, before any worker runs
+static bool use_hugepages = false;
+static bool warned = false;
+
+
+void memory_use_hugepages(bool use){
+	use_hugepages = use;
+}
+
+
+// 'bytes' rounded up to whole huge pages when they're in use, so a caller
+// can fill the rest of the last one rather than waste it
+size_t memory_round(size_t bytes){
+	if (!use_hugepages) return bytes;
+	return (bytes + HUGE_PAGE_BYTES - 1) / HUGE_PAGE_BYTES * HUGE_PAGE_BYTES;
+}
+
+
+/* Page aligned, zeroed memory that's never given back, preferring NUMA node
+ * 'node' if that's not -1.  Whole huge pages come from the huge page pool
+ * when it has any left, otherwise from normal pages the kernel is asked to
+ * back with transparent huge pages.
+ */
+void *memory_alloc(size_t bytes, int node){
+	void *memory = MAP_FAILED;
+	bool huge = use_hugepages && !(bytes % HUGE_PAGE_BYTES);
+	if (huge){
+		memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+					  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (memory == MAP_FAILED && !__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED)){
+			fprintf(stderr, "Warning: No huge pages (%s), using normal pages\n", 
+					strerror(errno));
+		}
+	}
+	if (memory == MAP_FAILED){
+		memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+					  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED){
+			fprintf(stderr, "Error: Out of memory for %zu bytes\n", bytes);
+			abort();
+		}
+		if (huge) madvise(memory, bytes, MADV_HUGEPAGE);
+	}
+	// Pages locked by mlockall() are already there, and have to be moved
+	if (node >= 0 && node < 64){
+		unsigned long mask = 1UL << node;
+		syscall(SYS_mbind, memory, bytes, MPOL_PREFERRED, &mask, 
+				8 * sizeof(mask) + 1, MPOL_MF_MOVE);
+	}
+	return memory;
+}
+
+
+// The NUMA node of an interface's device, or -1 for none or a virtual one
+int memory_iface_node(const char *iface){
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", iface);
+	FILE *file = fopen(path, "r");
+	if (!file) return -1;
+	int node = -1;
+	if (fscanf(file, "%d", &node) != 1) node = -1;
+	fclose(file);
+	return node;
+}
+
+
+// Have the calling thread's memory come from 'node' where it can
+void memory_prefer_node(int node){
+	if (node < 0 || node >= 64) return;
+	unsigned long mask = 1UL << node;
+	syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, 8 * sizeof(mask) + 1);
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <stddef.h>
+
+// Huge pages are taken to be the usual 2MB
+static const size_t HUGE_PAGE_BYTES = 2 << 20;
+
+void memory_use_hugepages(bool use);
+size_t memory_round(size_t bytes);
+void *memory_alloc(size_t bytes, int node);
+int memory_iface_node(const char *iface);
+void memory_prefer_node(int node);
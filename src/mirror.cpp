@@ -0,0 +1,106 @@
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include "mirror.h"
+
+
+void mirror_init(mirror_t &m){
+	m.sock = -1;
+	m.iface.clear();
+	m.dropped_vlan = 0;
+	m.vnet = false;
+	m.qdisc_bypass = false;
+	m.sent = 0;
+	m.lost = 0;
+}
+
+
+// (Re)open the mirror port if the config names a different one
+void mirror_open(mirror_t &m, const std::string &iface, int dropped_vlan){
+	m.dropped_vlan = dropped_vlan;
+	if (iface == m.iface) return;
+	if (m.sock >= 0) close(m.sock);
+	m.sock = -1;
+	m.iface = iface;
+	if (iface.empty()) return;
+	if (iface.size() > IFNAMSIZ - 1){
+		fprintf(stderr, "Error: Interface name '%s' too long\n", iface.c_str());
+		abort();
+	}
+	// Protocol 0: the socket only sends, so nothing queues up on it
+	m.sock = socket(PF_PACKET, SOCK_RAW, 0);
+	ifreq ifr;
+	strncpy(ifr.ifr_name, iface.c_str(), IFNAMSIZ);
+	if (m.sock < 0 || ioctl(m.sock, SIOCGIFINDEX, &ifr) < 0){
+		fprintf(stderr, "Error: Can't open mirror '%s': %s\n", iface.c_str(), 
+				strerror(errno));
+		abort();
+	}
+	sockaddr_ll sll;
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = ifr.ifr_ifindex;
+	bind(m.sock, (sockaddr *)&sll, sizeof(sll));
+	int on = 1;
+	if (m.vnet && setsockopt(m.sock, SOL_PACKET, PACKET_VNET_HDR, &on, sizeof(on)) < 0){
+		fprintf(stderr, "Error: No virtio-net headers on mirror '%s': %s\n", 
+				iface.c_str(), strerror(errno));
+		abort();
+	}
+	if (m.qdisc_bypass 
+		&& setsockopt(m.sock, SOL_PACKET, PACKET_QDISC_BYPASS, &on, sizeof(on)) < 0){
+		fprintf(stderr, "Warning: Mirror '%s' can't bypass its qdisc: %s\n", 
+				iface.c_str(), strerror(errno));
+	}
+}
+
+
+// Copy frames the real port has just taken; 'msgs' is reused as it is
+void mirror_sent(mirror_t &m, mmsghdr *msgs, int count){
+	int done = sendmmsg(m.sock, msgs, count, MSG_DONTWAIT);
+	if (done < 0) done = 0;
+	m.sent += done;
+	m.lost += count - done;
+}
+
+
+// Copy a dropped frame, with a VLAN tag put in front of any it has
+void mirror_dropped(mirror_t &m, const packet_t *packet){
+	if (packet->len < 2 * ETH_ALEN){
+		++m.lost;
+		return;
+	}
+	uint16_t tag[2] = {htons(ETH_P_8021Q), htons(m.dropped_vlan)};
+	// What the header says of the headers moves along with them
+	vnet_hdr_t vnet = packet->vnet;
+	if (vnet.flags & VNET_NEEDS_CSUM) vnet.csum_start += sizeof(tag);
+	if (vnet.hdr_len) vnet.hdr_len += sizeof(tag);
+	iovec iov[4] = {
+		{&vnet, sizeof(vnet)},
+		{(void *)packet->data, 2 * ETH_ALEN},
+		{tag, sizeof(tag)},
+		{(void *)&packet->data[2 * ETH_ALEN], (size_t)packet->len - 2 * ETH_ALEN}};
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = m.vnet ? iov : &iov[1];
+	msg.msg_iovlen = m.vnet ? 4 : 3;
+	if (sendmsg(m.sock, &msg, MSG_DONTWAIT) < 0) ++m.lost;
+	else ++m.sent;
+}
+
+
+void mirror_print_stats(const mirror_t &m, const char *name){
+	if (m.sock < 0) return;
+	printf("%s%smirror to %s: sent %lu lost %lu\n", name, *name ? " " : "", 
+		   m.iface.c_str(), m.sent, m.lost);
+	fflush(stdout);
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <string>
+
+#include "packet.h"
+
+/* A monitor port, sent a copy of each frame as it leaves.  Copies are sent
+ * from the same buffers as the frames themselves, without waiting: when the
+ * monitor can't keep up its copies are lost, never the frames.
+ */
+struct mirror_t{
+	// -1 while there's no mirror port
+	int sock;
+	std::string iface;
+	int dropped_vlan;
+	// Copies go after a virtio-net header, as the ports' frames do
+	bool vnet;
+	// Copies go straight to the device, past its qdisc
+	bool qdisc_bypass;
+	uint64_t sent;
+	uint64_t lost;
+};
+
+void mirror_init(mirror_t &m);
+void mirror_open(mirror_t &m, const std::string &iface, int dropped_vlan);
+void mirror_sent(mirror_t &m, mmsghdr *msgs, int count);
+void mirror_dropped(mirror_t &m, const packet_t *packet);
+void mirror_print_stats(const mirror_t &m, const char *name);
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "packet.h"
+#include "memory.h"
+
+// Buffers are carved out of slabs of at least this many, and never given
+// back.  With huge pages a slab fills whole ones.
+static const int POOL_GROW = 256;
+
+// Free buffers of one size
+struct pool_t{
+	int size;
+	std::vector<packet_t *> free;
+};
+
+// Each worker thread has its own pools, one for each size of buffer it
+// uses; a frame never leaves the thread that read it
+static thread_local std::vector<pool_t> pools;
+
+
+static pool_t &pool(int size){
+	for (pool_t &p : pools){
+		if (p.size == size) return p;
+	}
+	pools.push_back(pool_t());
+	pools.back().size = size;
+	return pools.back();
+}
+
+
+// A buffer's header and data, each buffer starting on a cache line
+static size_t stride(int size){
+	return (sizeof(packet_t) + size + 63) & ~(size_t)63;
+}
+
+
+static void pool_grow(pool_t &p){
+	size_t bytes = memory_round(stride(p.size) * POOL_GROW);
+	char *slab = (char *)memory_alloc(bytes, -1);
+	int count = bytes / stride(p.size);
+	p.free.reserve(p.free.capacity() + count);
+	for (int i=0; i<count; ++i){
+		packet_t *packet = (packet_t *)(slab + i * stride(p.size));
+		packet->size = p.size;
+		p.free.push_back(packet);
+	}
+}
+
+
+packet_t *packet_alloc(int size){
+	pool_t &p = pool(size);
+	if (p.free.empty()) pool_grow(p);
+	packet_t *packet = p.free.back();
+	p.free.pop_back();
+	packet->refs = 1;
+	packet->len = 0;
+	memset(&packet->vnet, 0, sizeof(packet->vnet));
+	packet->snapped = false;
+	return packet;
+}
+
+
+// Takes over a reference to 'packet', and returns one to a buffer only the
+// caller holds, copying the frame if anything else still refers to it
+packet_t *packet_writable(packet_t *packet){
+	if (packet->refs == 1) return packet;
+	packet_t *copy = packet_alloc(packet->size);
+	memcpy(copy->data, packet->data, packet->len);
+	copy->len = packet->len;
+	copy->vnet = packet->vnet;
+	copy->snapped = packet->snapped;
+	packet_unref(packet);
+	return copy;
+}
+
+
+// Have at least 'count' buffers of 'size' ready, each touched so it can't
+// fault later
+void packet_pool_reserve(int count, int size){
+	pool_t &p = pool(size);
+	while ((int)p.free.size() < count) pool_grow(p);
+	for (packet_t *packet : p.free) memset(packet->data, 0, size);
+}
+
+
+void packet_free(packet_t *packet){
+	pool(packet->size).free.push_back(packet);
+}
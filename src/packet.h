@@ -0,0 +1,40 @@
+#pragma once
+
+#include "vnet.h"
+
+static const int PACKET_SIZE = 1600;
+// A GSO frame: link headers and up to 64KB of IP datagram
+static const int PACKET_GSO_SIZE = 65536 + 256;
+
+/* A received frame.  Queues hold references rather than copies, so one
+ * buffer can be sent several times; it goes back to the pool once the last
+ * reference is dropped.
+ */
+struct packet_t{
+	int refs;
+	int len;
+	// Room at 'data'
+	int size;
+	// What the kernel said of the frame, for it to go out the same way: the
+	// segments a GSO frame stands for, and a checksum left for the sender.
+	// All zero for a plain frame.
+	vnet_hdr_t vnet;
+	// Only the first bytes were read, the rest being about to be cut off
+	bool snapped;
+	char data[];
+};
+
+packet_t *packet_alloc(int size=PACKET_SIZE);
+packet_t *packet_writable(packet_t *packet);
+void packet_pool_reserve(int count, int size=PACKET_SIZE);
+
+static inline packet_t *packet_ref(packet_t *packet){
+	++packet->refs;
+	return packet;
+}
+
+void packet_free(packet_t *packet);
+
+static inline void packet_unref(packet_t *packet){
+	if (--packet->refs == 0) packet_free(packet);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+#include <deque>
+
+#include "packet.h"
+
+typedef std::deque<packet_t *> queue_t;
+
+static const uint64_t NS_PER_US = 1000;
+static const uint64_t NS_PER_SEC = 1000000000;
+
+static inline uint64_t timespec_ns(const timespec &t){
+	return t.tv_sec * NS_PER_SEC + t.tv_nsec;
+}
+
+static inline timespec ns_timespec(uint64_t ns){
+	timespec t = {(time_t)(ns / NS_PER_SEC), (long)(ns % NS_PER_SEC)};
+	return t;
+}
+
+// The sooner of two wake up times, where 0 means never
+static inline uint64_t earliest(uint64_t a, uint64_t b){
+	if (!a) return b;
+	if (!b) return a;
+	return (a < b) ? a : b;
+}
@@ -0,0 +1,220 @@
+#include "filter.h"
+#include "direction.h"
+#include "reorder.h"
+
+
+static void wheel_init(reorder_wheel_t &w, uint64_t cursor){
+	for (int i=0; i<REORDER_SLOTS; ++i){
+		w.head[i] = -1;
+		w.tail[i] = -1;
+	}
+	for (int i=0; i<WHEEL_WORDS; ++i) w.used[i] = 0;
+	for (int i=0; i<WHEEL_GROUPS; ++i) w.used_words[i] = 0;
+	w.cursor = cursor;
+	w.count = 0;
+}
+
+
+// The first word of the bitmap in use at or after 'word', wrapping round
+static int next_word(const reorder_wheel_t &w, int word){
+	// The last look takes in the words before 'word' in its group
+	for (int i=0; i<=WHEEL_GROUPS; ++i){
+		int group = (word / 64 + i) % WHEEL_GROUPS;
+		uint64_t bits = w.used_words[group];
+		if (i == 0) bits &= ~0ull << (word % 64);
+		if (bits) return group * 64 + __builtin_ctzll(bits);
+	}
+	return -1;
+}
+
+
+// How many ticks past the cursor the next frame is due; the wheel mustn't
+// be empty
+static uint64_t wheel_next(const reorder_wheel_t &w){
+	int from = w.cursor % REORDER_SLOTS;
+	int word = from / 64;
+	uint64_t bits = w.used[word] & (~0ull << (from % 64));
+	if (!bits){
+		word = next_word(w, (word + 1) % WHEEL_WORDS);
+		bits = w.used[word];
+	}
+	int slot = word * 64 + __builtin_ctzll(bits);
+	return (slot - from + REORDER_SLOTS) % REORDER_SLOTS;
+}
+
+
+// Takes over the caller's reference to 'packet'
+static void wheel_hold(reorder_t &r, reorder_wheel_t &w, uint64_t due,
+					   packet_t *packet){
+	int entry = r.free;
+	r.free = r.next[entry];
+	r.held[entry] = packet;
+	r.next[entry] = -1;
+	int slot = due % REORDER_SLOTS;
+	if (w.tail[slot] < 0){
+		w.head[slot] = entry;
+		int word = slot / 64;
+		w.used[word] |= 1ull << (slot % 64);
+		w.used_words[word / 64] |= 1ull << (word % 64);
+	} else {
+		r.next[w.tail[slot]] = entry;
+	}
+	w.tail[slot] = entry;
+	++w.count;
+}
+
+
+static void depart(direction_t &d, packet_t *packet, uint64_t now);
+
+
+// Pass everything due up to and including 'upto' along
+static void wheel_release(direction_t &d, reorder_wheel_t &w, uint64_t upto,
+						  uint64_t now){
+	reorder_t &r = d.reorder;
+	if (upto < w.cursor) return;
+	if (w.count == 0){
+		w.cursor = upto + 1;
+		return;
+	}
+	uint64_t end = upto + 1;
+	if (end - w.cursor > REORDER_SLOTS) end = w.cursor + REORDER_SLOTS;
+	while (w.count){
+		uint64_t due = w.cursor + wheel_next(w);
+		if (due >= end) break;
+		w.cursor = due + 1;
+		int slot = due % REORDER_SLOTS;
+		int entry = w.head[slot];
+		w.head[slot] = -1;
+		w.tail[slot] = -1;
+		int word = slot / 64;
+		w.used[word] &= ~(1ull << (slot % 64));
+		if (!w.used[word]) w.used_words[word / 64] &= ~(1ull << (word % 64));
+		while (entry >= 0){
+			int next = r.next[entry];
+			packet_t *packet = r.held[entry];
+			r.next[entry] = r.free;
+			r.free = entry;
+			--w.count;
+			if (&w == &r.by_time) depart(d, packet, now);
+			else d.queue.push_back(packet);
+			entry = next;
+		}
+	}
+	w.cursor = upto + 1;
+}
+
+
+// Queue a frame leaving the delay line, possibly out of order
+static void depart(direction_t &d, packet_t *packet, uint64_t now){
+	reorder_t &r = d.reorder;
+	queue_t &queue = d.queue;
+	long offset = d.config->reorder_distance ? reorder_offset(d) : 0;
+	if (offset > 0 && r.free < 0) offset = 0;
+	if (offset < 0){
+		// The distance is bounded by reorder_distance, so the deque
+		// insert stays cheap
+		size_t ahead = queue.size();
+		if ((size_t)-offset < ahead) ahead = -offset;
+		queue.insert(queue.end() - ahead, packet);
+	} else if (offset > 0){
+		wheel_hold(r, r.by_position, r.departures + offset, packet);
+	} else {
+		queue.push_back(packet);
+	}
+	wheel_release(d, r.by_position, r.departures, now);
+	++r.departures;
+	r.last_departure = now;
+}
+
+
+void reorder_reset(direction_t &d, uint64_t now){
+	reorder_t &r = d.reorder;
+	const direction_config_t &config = *d.config;
+	wheel_release(d, r.by_time, r.by_time.cursor + REORDER_SLOTS, now);
+	wheel_release(d, r.by_position, r.by_position.cursor + REORDER_SLOTS, now);
+	// Size the ticks so the longest possible hold fits on the wheel
+	uint64_t longest = config.reorder_delay + config.delay_max
+		+ config.duplicate_delay * config.duplicate_copies;
+	r.tick_ns = NS_PER_US;
+	if (longest){
+		uint64_t tick = (longest + REORDER_SLOTS - 3) / (REORDER_SLOTS - 2);
+		if (tick > r.tick_ns) r.tick_ns = tick;
+	}
+	r.departures = 0;
+	r.last_departure = now;
+	for (int i=0; i<PROFILES_MAX; ++i) r.rate_next[i] = 0;
+	wheel_init(r.by_position, 0);
+	wheel_init(r.by_time, now / r.tick_ns);
+	r.free = 0;
+	for (int i=0; i<REORDER_HELD; ++i){
+		r.next[i] = (i + 1 < REORDER_HELD) ? i + 1 : -1;
+	}
+}
+
+
+// Returns false if the frame had to be dropped
+bool reorder_enqueue(direction_t &d, packet_t *packet, int profile, 
+					 flow_t *flow, uint64_t extra_delay, uint64_t now){
+	reorder_t &r = d.reorder;
+	const profile_t &impair = d.config->profiles[profile];
+	uint64_t delay = delay_sample(d, impair) + extra_delay;
+	// A class's rate limit works like netem's: each frame waits for the
+	// one before it to finish sending
+	uint64_t &rate_next = r.rate_next[profile];
+	uint64_t rate_wait = (impair.rate && rate_next > now) ? rate_next - now : 0;
+	bool flow_rate = flow && impair.flow_rate;
+	if (flow_rate && flow->rate_next > now + rate_wait){
+		rate_wait = flow->rate_next - now;
+	}
+	delay += rate_wait;
+	if (d.config->reorder_delay){
+		long offset = reorder_offset(d);
+		if (offset < 0 && !delay){
+			// Nothing to send it early against but the queue itself
+			d.queue.push_front(packet_ref(packet));
+			return true;
+		}
+		if (offset < 0 && (uint64_t)-offset >= delay) delay = 0;
+		else delay += offset;
+	}
+	// Like netem's limit, frames that can't be held are lost
+	uint64_t ticks = (delay + r.tick_ns - 1) / r.tick_ns;
+	wheel_release(d, r.by_time, now / r.tick_ns, now);
+	if (delay && (r.free < 0 || ticks >= REORDER_SLOTS - 1)){
+		++d.stats.dropped;
+		return false;
+	}
+	if (impair.rate) rate_next = now + rate_wait + packet->len * impair.rate;
+	if (flow_rate) flow->rate_next = now + rate_wait + packet->len * impair.flow_rate;
+	if (!delay){
+		depart(d, packet_ref(packet), now);
+		return true;
+	}
+	wheel_hold(r, r.by_time, now / r.tick_ns + ticks, packet_ref(packet));
+	return true;
+}
+
+
+void reorder_release(direction_t &d, uint64_t now){
+	reorder_t &r = d.reorder;
+	wheel_release(d, r.by_time, now / r.tick_ns, now);
+	if (r.by_position.count && now - r.last_departure >= REORDER_STALL_NS){
+		wheel_release(d, r.by_position, r.by_position.cursor + REORDER_SLOTS, 
+					  now);
+		r.departures = r.by_position.cursor;
+	}
+}
+
+
+// When reorder_release() next has work to do, or 0 if nothing is held
+uint64_t reorder_next_wake(direction_t &d){
+	reorder_t &r = d.reorder;
+	uint64_t wake = 0;
+	if (r.by_position.count) wake = r.last_departure + REORDER_STALL_NS;
+	if (r.by_time.count){
+		reorder_wheel_t &w = r.by_time;
+		uint64_t tick = w.cursor + wheel_next(w);
+		if (!wake || tick * r.tick_ns < wake) wake = tick * r.tick_ns;
+	}
+	return wake;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+
+#include "queue.h"
+#include "classify.h"
+#include "flow.h"
+
+/* Frames passed in are referenced, not taken over, by the queue or wheel
+ * they end up on.
+ */
+
+// Furthest a frame can be held back, in frames or wheel ticks
+static const int REORDER_SLOTS = 16384;
+// Most frames held back at once, per direction
+static const int REORDER_HELD = 65536;
+// Frames held back by position are let go if nothing arrives to pass them
+static const uint64_t REORDER_STALL_NS = 10 * 1000 * 1000;
+// How far a profile's rate limit may fall behind before frames are dropped
+static const uint64_t RATE_BACKLOG_NS = 100 * 1000 * 1000;
+
+// Words of a wheel's bitmap of slots in use, and of its summary of those
+static const int WHEEL_WORDS = REORDER_SLOTS / 64;
+static const int WHEEL_GROUPS = WHEEL_WORDS / 64;
+
+/* Held frames hang off a wheel of slots indexed by the frame count or clock
+ * tick at which they're due, so holding and releasing a frame is O(1).  A
+ * bitmap of the slots in use, summed up one bit a word, finds the next
+ * frame due in a few words' look.  Frames are delayed on the time wheel
+ * first, then may be displaced by position as they leave it.
+ */
+struct reorder_wheel_t{
+	int head[REORDER_SLOTS];
+	int tail[REORDER_SLOTS];
+	uint64_t used[WHEEL_WORDS];
+	uint64_t used_words[WHEEL_GROUPS];
+	uint64_t cursor;
+	int count;
+};
+
+struct reorder_t{
+	reorder_wheel_t by_position;
+	reorder_wheel_t by_time;
+	packet_t *held[REORDER_HELD];
+	int next[REORDER_HELD];
+	int free;
+	uint64_t tick_ns;
+	uint64_t departures;
+	uint64_t last_departure;
+	uint64_t rate_next[PROFILES_MAX];
+};
+
+struct direction_t;
+
+// Held frames are passed on to the direction's send queue
+void reorder_reset(direction_t &d, uint64_t now);
+bool reorder_enqueue(direction_t &d, packet_t *packet, int profile, 
+					 flow_t *flow, uint64_t extra_delay, uint64_t now);
+void reorder_release(direction_t &d, uint64_t now);
+uint64_t reorder_next_wake(direction_t &d);
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+
+static const int RING_SIZE = 64;
+
+// A command, and whatever goes with it
+struct message_t{
+	uint64_t command;
+	void *data;
+};
+
+/* A lock free ring of messages from one thread to one other.  Only the
+ * producer writes 'head' and only the consumer 'tail', each on a cache line
+ * of its own, so neither ever waits on the other.
+ */
+struct ring_t{
+	alignas(64) unsigned long head;
+	alignas(64) unsigned long tail;
+	alignas(64) message_t slots[RING_SIZE];
+};
+
+// Returns false if the ring is full
+static inline bool ring_push(ring_t &r, const message_t &message){
+	unsigned long head = r.head;
+	if (head - __atomic_load_n(&r.tail, __ATOMIC_ACQUIRE) == RING_SIZE) return false;
+	r.slots[head % RING_SIZE] = message;
+	__atomic_store_n(&r.head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Returns false if the ring is empty
+static inline bool ring_pop(ring_t &r, message_t &message){
+	unsigned long tail = r.tail;
+	if (__atomic_load_n(&r.head, __ATOMIC_ACQUIRE) == tail) return false;
+	message = r.slots[tail % RING_SIZE];
+	__atomic_store_n(&r.tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
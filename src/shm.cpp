@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "shm.h"
+#include "direction.h"
+
+// Set up at startup, before the thread serving them starts
+static std::vector<shm_port_t *> ports;
+
+
+static void fail(const char *name, const char *what){
+	fprintf(stderr, "Error: Can't set up shared memory port %s (%s: %s)\n",
+			name, what, strerror(errno));
+	abort();
+}
+
+
+shm_port_t *shm_port_open(const char *name){
+	shm_port_t *p = new shm_port_t();
+	p->name = name;
+	p->size = sizeof(shm_region_t);
+	std::string path = "brokenhub-" + p->name;
+	p->memfd = memfd_create(path.c_str(), MFD_CLOEXEC);
+	if (p->memfd < 0 || ftruncate(p->memfd, p->size) < 0) fail(name, "memfd");
+	void *memory = mmap(NULL, p->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+						p->memfd, 0);
+	if (memory == MAP_FAILED) fail(name, "mmap");
+	shm_region_t &r = *(shm_region_t *)memory;
+	r.magic = SHM_MAGIC;
+	r.version = SHM_VERSION;
+	r.slots = SHM_SLOTS;
+	r.buf_size = SHM_BUF_SIZE;
+	for (int ring=0; ring<2; ++ring){
+		for (uint32_t slot=0; slot<SHM_SLOTS; ++slot){
+			r.rings[ring].desc[slot].offset = r.buffers[ring][slot] - (char *)&r;
+		}
+	}
+	p->region = &r;
+	p->hub_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	p->peer_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (p->hub_event < 0 || p->peer_event < 0) fail(name, "eventfd");
+
+	// An abstract socket, named with a leading 0
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	path = "brokenhub/" + p->name;
+	if (path.size() >= sizeof(addr.sun_path) - 1){
+		errno = ENAMETOOLONG;
+		fail(name, "socket");
+	}
+	memcpy(addr.sun_path + 1, path.data(), path.size());
+	socklen_t len = offsetof(sockaddr_un, sun_path) + 1 + path.size();
+	p->listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (p->listener < 0 || bind(p->listener, (sockaddr *)&addr, len) < 0
+		|| listen(p->listener, 4) < 0){
+		fail(name, "socket");
+	}
+	ports.push_back(p);
+	return p;
+}
+
+
+// Hand a peer the region and the eventfds
+static void serve_peer(shm_port_t &p, int conn){
+	uint64_t size = p.size;
+	iovec iov = {&size, sizeof(size)};
+	int fds[3] = {p.memfd, p.hub_event, p.peer_event};
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if (sendmsg(conn, &msg, MSG_NOSIGNAL) < 0){
+		fprintf(stderr, "Shared memory port %s: can't send to peer: %s\n",
+				p.name.c_str(), strerror(errno));
+	}
+}
+
+
+// Whether the process on the far end of 'conn' may have the port
+static bool trusted(shm_port_t &p, int conn){
+	ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return false;
+	if (cred.uid == 0 || cred.uid == geteuid()) return true;
+	fprintf(stderr, "Shared memory port %s: turned away user %u\n", 
+			p.name.c_str(), cred.uid);
+	return false;
+}
+
+
+/* Each port's listener comes with the connection of the peer using it, or
+ * -1.  A ring has one producer and one consumer each way, so a second
+ * peer is turned away until the first hangs up.
+ */
+static void *serve(void *){
+	std::vector<pollfd> fds(2 * ports.size());
+	for (size_t i=0; i<ports.size(); ++i){
+		fds[2 * i].fd = ports[i]->listener;
+		fds[2 * i].events = POLLIN;
+		fds[2 * i + 1].fd = -1;
+		fds[2 * i + 1].events = POLLIN;
+	}
+	while (1){
+		if (poll(fds.data(), fds.size(), -1) < 0) continue;
+		for (size_t i=0; i<ports.size(); ++i){
+			pollfd &peer = fds[2 * i + 1];
+			if (peer.fd >= 0 && peer.revents){
+				char byte;
+				int got = recv(peer.fd, &byte, 1, MSG_DONTWAIT);
+				if (got == 0 || (got < 0 && errno != EAGAIN)){
+					close(peer.fd);
+					peer.fd = -1;
+				}
+			}
+			if (!(fds[2 * i].revents & POLLIN)) continue;
+			int conn = accept4(fds[2 * i].fd, NULL, NULL, SOCK_CLOEXEC);
+			if (conn < 0) continue;
+			if (peer.fd >= 0){
+				fprintf(stderr, "Shared memory port %s: already has a peer\n",
+						ports[i]->name.c_str());
+			}
+			if (peer.fd >= 0 || !trusted(*ports[i], conn)){
+				close(conn);
+				continue;
+			}
+			serve_peer(*ports[i], conn);
+			peer.fd = conn;
+		}
+	}
+	return NULL;
+}
+
+
+// Answer peers on a thread of its own, if there are any ports
+void shm_serve(){
+	if (ports.empty()) return;
+	pthread_t thread;
+	int error = pthread_create(&thread, NULL, serve, NULL);
+	if (error){
+		fprintf(stderr, "Error: Can't serve shared memory ports: %s\n",
+				strerror(error));
+		abort();
+	}
+	pthread_detach(thread);
+}
+
+
+static void wake_peer(shm_port_t &p){
+	uint64_t one = 1;
+	write(p.peer_event, &one, sizeof(one));
+}
+
+
+// Take the next frame from the peer, as read() would
+int shm_read(shm_port_t &p, char *data, int size){
+	shm_ring_t &ring = p.region->rings[SHM_TO_HUB];
+	const shm_desc_t *desc = shm_peek(ring);
+	if (!desc){
+		errno = EAGAIN;
+		return -1;
+	}
+	// What the peer wrote can't be trusted to fit, nor to stay put
+	uint32_t length = __atomic_load_n(&desc->length, __ATOMIC_RELAXED);
+	int len = std::min(std::min(length, SHM_BUF_SIZE), (uint32_t)size);
+	memcpy(data, p.region->buffers[SHM_TO_HUB][ring.tail % SHM_SLOTS], len);
+	shm_next(ring);
+	if (shm_wake(ring.producer_waiting)) wake_peer(p);
+	return len;
+}
+
+
+// Say, the first time, that a frame of 'len' bytes was too long for a slot
+static void warn_long(int len){
+	static bool warned = false;
+	if (!__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED)){
+		fprintf(stderr, "Warning: Frames longer than a shared memory slot's %u "
+				"bytes dropped (first was %i)\n", SHM_BUF_SIZE, len);
+	}
+}
+
+
+/* transmit() for a shared memory port: copy frames from the front of the
+ * direction's queue into the ring to the peer, until it's full.  Frames too
+ * long for a slot are dropped rather than retried forever.
+ */
+int shm_transmit(shm_port_t &p, direction_t &d, int max_packets, long max_bytes,
+				 mirror_t *mirror, long &sent_bytes){
+	shm_ring_t &ring = p.region->rings[SHM_FROM_HUB];
+	queue_t &queue = d.queue;
+	int sent = 0;
+	sent_bytes = 0;
+	while (sent < max_packets && !queue.empty()){
+		packet_t *packet = queue.front();
+		if (packet->len > (int)SHM_BUF_SIZE){
+			warn_long(packet->len);
+			++d.stats.dropped;
+			queue.pop_front();
+			packet_unref(packet);
+			continue;
+		}
+		if (sent && sent_bytes + packet->len > max_bytes) break;
+		if (!shm_put(*p.region, SHM_FROM_HUB, packet->data, packet->len)){
+			// Have the peer say when it has made room
+			__atomic_store_n(&ring.producer_waiting, 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (!shm_put(*p.region, SHM_FROM_HUB, packet->data, packet->len)) break;
+		}
+		if (mirror){
+			iovec iov[2] = {{&packet->vnet, sizeof(vnet_hdr_t)},
+							{packet->data, (size_t)packet->len}};
+			mmsghdr copy;
+			memset(&copy, 0, sizeof(copy));
+			copy.msg_hdr.msg_iov = mirror->vnet ? iov : &iov[1];
+			copy.msg_hdr.msg_iovlen = mirror->vnet ? 2 : 1;
+			mirror_sent(*mirror, &copy, 1);
+		}
+		sent_bytes += packet->len;
+		queue.pop_front();
+		packet_unref(packet);
+		++sent;
+	}
+	if (sent && shm_wake(ring.consumer_waiting)) wake_peer(p);
+	return sent;
+}
+
+
+void shm_drain(shm_port_t &p){
+	uint64_t count;
+	read(p.hub_event, &count, sizeof(count));
+}
+
+
+// Say the hub is about to sleep; false if the peer has sent frames since
+bool shm_idle(shm_port_t &p){
+	shm_ring_t &ring = p.region->rings[SHM_TO_HUB];
+	__atomic_store_n(&ring.consumer_waiting, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return !shm_peek(ring);
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "queue.h"
+#include "mirror.h"
+
+/* A port that's a pair of rings in memory shared with another process on
+ * the host, which exchanges frames with the hub through them without the
+ * kernel's network stack.
+ *
+ * The peer connects to the abstract UNIX socket "@brokenhub/NAME" for the
+ * port "shm:NAME", and is sent one message: the region's size as a
+ * uint64_t, and three descriptors, the region's memfd, the hub's eventfd
+ * and the peer's.  It maps the whole region shared and read/write.
+ *
+ * The region starts with a shm_region_t.  rings[SHM_TO_HUB] carries frames
+ * from the peer and rings[SHM_FROM_HUB] frames to it.  Each ring has one
+ * producer and one consumer, and free running 32 bit counters: the
+ * producer fills the slot at head % slots and then increments head, the
+ * consumer takes the one at tail % slots and then increments tail.  Slot
+ * i's buffer is always the one at desc[i].offset, buf_size bytes long.
+ * The hub only ever writes the offsets: it finds its buffers itself, so a
+ * peer can't point it outside the region.
+ *
+ * Only one peer at a time is let in, and only one run by root or by the
+ * hub's own user.  It keeps the connection open as long as it uses the
+ * port; once it's closed, another may connect.
+ *
+ * Before sleeping on its eventfd, a side sets the ring's consumer_waiting
+ * (found it empty) or producer_waiting (found it full), and looks once
+ * more.  Having moved head or tail, a side that finds the other's flag set
+ * clears it and writes 1 to the other's eventfd.
+ */
+
+static const uint32_t SHM_MAGIC = 0x68736862;
+static const uint32_t SHM_VERSION = 1;
+static const uint32_t SHM_SLOTS = 1024;
+static const uint32_t SHM_BUF_SIZE = 2048;
+
+static const int SHM_TO_HUB = 0;
+static const int SHM_FROM_HUB = 1;
+
+// 16 bytes, four to a cache line
+struct shm_desc_t{
+	// From the start of the region, set by the hub for the peer
+	uint32_t offset;
+	// Of the frame, set by the producer
+	uint32_t length;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+// Each side's counter and flag on a cache line of its own
+struct shm_ring_t{
+	alignas(64) uint32_t head;
+	uint32_t producer_waiting;
+	alignas(64) uint32_t tail;
+	uint32_t consumer_waiting;
+	alignas(64) shm_desc_t desc[SHM_SLOTS];
+};
+
+struct shm_region_t{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t buf_size;
+	shm_ring_t rings[2];
+	alignas(64) char buffers[2][SHM_SLOTS][SHM_BUF_SIZE];
+};
+
+// Producer: copy a frame of up to SHM_BUF_SIZE bytes into the next slot of
+// rings[index]; false if the ring is full
+static inline bool shm_put(shm_region_t &r, int index, const void *data,
+						   uint32_t len){
+	shm_ring_t &ring = r.rings[index];
+	uint32_t head = ring.head;
+	if (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == SHM_SLOTS) return false;
+	memcpy(r.buffers[index][head % SHM_SLOTS], data, len);
+	ring.desc[head % SHM_SLOTS].length = len;
+	__atomic_store_n(&ring.head, head + 1, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+// Consumer: the next frame's slot, or NULL if the ring is empty
+static inline const shm_desc_t *shm_peek(shm_ring_t &ring){
+	uint32_t tail = ring.tail;
+	if (__atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) == tail) return NULL;
+	return &ring.desc[tail % SHM_SLOTS];
+}
+
+// Consumer: done with the frame shm_peek() gave
+static inline void shm_next(shm_ring_t &ring){
+	__atomic_store_n(&ring.tail, ring.tail + 1, __ATOMIC_SEQ_CST);
+}
+
+// Whether the side waiting on 'flag' needs waking, now the ring has moved
+static inline bool shm_wake(uint32_t &flag){
+	return __atomic_load_n(&flag, __ATOMIC_SEQ_CST)
+		&& __atomic_exchange_n(&flag, 0, __ATOMIC_SEQ_CST);
+}
+
+struct direction_t;
+
+// The hub's end of a port
+struct shm_port_t{
+	std::string name;
+	shm_region_t *region;
+	size_t size;
+	int memfd;
+	// Written by the peer to wake the hub, and by the hub to wake the peer
+	int hub_event;
+	int peer_event;
+	// Where peers come for the descriptors
+	int listener;
+};
+
+shm_port_t *shm_port_open(const char *name);
+void shm_serve();
+int shm_read(shm_port_t &p, char *data, int size);
+int shm_transmit(shm_port_t &p, direction_t &d, int max_packets, long max_bytes,
+				 mirror_t *mirror, long &sent_bytes);
+void shm_drain(shm_port_t &p);
+bool shm_idle(shm_port_t &p);
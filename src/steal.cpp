@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+
+#include <new>
+#include <algorithm>
+
+#include "steal.h"
+#include "bridge.h"
+#include "memory.h"
+
+
+steal_queue_t *steal_queue_new(int node){
+	void *memory = memory_alloc(sizeof(steal_queue_t), node);
+	return new (memory) steal_queue_t();
+}
+
+
+// Owner only; makes room by doing its own work if the queue is full
+void steal_publish(steal_queue_t &q, const steal_item_t &item, uint64_t now){
+	while (q.published - q.committed == STEAL_SLOTS){
+		if (!steal_work(q, STEAL_SLOTS)) sched_yield();
+		steal_commit(q, now);
+	}
+	steal_item_t &slot = q.items[q.published % STEAL_SLOTS];
+	slot = item;
+	slot.done = 0;
+	__atomic_store_n(&q.published, q.published + 1, __ATOMIC_SEQ_CST);
+}
+
+
+// Claim up to 'max' frames and impair them; returns how many were done
+int steal_work(steal_queue_t &q, int max){
+	unsigned long first = __atomic_load_n(&q.claimed, __ATOMIC_ACQUIRE);
+	unsigned long count;
+	do {
+		unsigned long published = __atomic_load_n(&q.published, __ATOMIC_ACQUIRE);
+		if (first >= published) return 0;
+		count = std::min((unsigned long)max, published - first);
+	} while (!__atomic_compare_exchange_n(&q.claimed, &first, first + count, 
+										  false, __ATOMIC_ACQ_REL, 
+										  __ATOMIC_ACQUIRE));
+	for (unsigned long i=first; i<first + count; ++i){
+		steal_item_t &item = q.items[i % STEAL_SLOTS];
+		if (item.kept) impair(item.packet, item.work);
+		__atomic_store_n(&item.done, 1, __ATOMIC_RELEASE);
+	}
+	return count;
+}
+
+
+// Owner only: pass finished frames on, stopping at the first unfinished one
+void steal_commit(steal_queue_t &q, uint64_t now){
+	while (q.committed != q.published){
+		steal_item_t &item = q.items[q.committed % STEAL_SLOTS];
+		if (!__atomic_load_n(&item.done, __ATOMIC_ACQUIRE)) break;
+		deliver(*item.d, item.packet, item.profile, item.flow, item.mirror, 
+				item.kept, now);
+		++q.committed;
+	}
+}
+
+
+// Owner only: finish everything in flight, before the config changes
+void steal_drain(steal_queue_t &q, uint64_t now){
+	while (steal_pending(q)){
+		if (!steal_work(q, STEAL_SLOTS)) sched_yield();
+		steal_commit(q, now);
+	}
+}
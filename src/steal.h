@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+
+#include "filter.h"
+#include "direction.h"
+#include "mirror.h"
+
+// Frames a worker can have in flight; a power of two
+static const int STEAL_SLOTS = 1024;
+// Most frames another worker takes at a time
+static const int STEAL_BATCH = 16;
+
+// A frame whose fate is decided, on its way to its direction's queue
+struct steal_item_t{
+	direction_t *d;
+	packet_t *packet;
+	flow_t *flow;
+	mirror_t *mirror;
+	int profile;
+	bool kept;
+	impair_t work;
+	// Set by whoever claimed the item once its work is done
+	int done;
+};
+
+/* A worker's frames in arrival order.  The worker adds them at 'published'
+ * and any worker, itself included, claims batches from 'claimed' on and
+ * impairs them.  Only the owner commits them, from 'committed' and in order,
+ * so frames leave in the order they came whoever did their work.
+ */
+struct steal_queue_t{
+	alignas(64) unsigned long published;
+	alignas(64) unsigned long claimed;
+	alignas(64) unsigned long committed;
+	steal_item_t items[STEAL_SLOTS];
+};
+
+steal_queue_t *steal_queue_new(int node);
+void steal_publish(steal_queue_t &q, const steal_item_t &item, uint64_t now);
+int steal_work(steal_queue_t &q, int max);
+void steal_commit(steal_queue_t &q, uint64_t now);
+void steal_drain(steal_queue_t &q, uint64_t now);
+
+// Frames published but not yet claimed
+static inline unsigned long steal_backlog(const steal_queue_t &q){
+	return __atomic_load_n(&q.published, __ATOMIC_SEQ_CST) 
+		- __atomic_load_n(&q.claimed, __ATOMIC_SEQ_CST);
+}
+
+// Whether frames are waiting to be committed
+static inline bool steal_pending(const steal_queue_t &q){
+	return q.committed != q.published;
+}
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "filter.h"
+#include "direction.h"
+#include "transmit.h"
+#include "gso.h"
+
+
+/* Send frames from the front of 'queue', at most 'max_packets' of them and,
+ * after the first, no more than 'max_bytes' in total, counted as they are
+ * on the wire.  Returns the number of frames taken off the queue.  Frames
+ * sent are copied to 'mirror', if there is one.  With 'vnet', each goes
+ * after its virtio-net header.
+ */
+int transmit(int sock, bool vnet, queue_t &queue, int max_packets, long max_bytes,
+			 mirror_t *mirror, long &sent_bytes){
+	mmsghdr msgs[TX_BATCH];
+	iovec iovs[TX_BATCH][2];
+	int sent = 0;
+	sent_bytes = 0;
+	while (sent < max_packets && !queue.empty()){
+		int batch = 0;
+		long bytes = sent_bytes;
+		for (queue_t::iterator it = queue.begin(); 
+			 it != queue.end() && batch < TX_BATCH 
+				 && sent + batch < max_packets; ++it){
+			packet_t *packet = *it;
+			long len = gso_wire_len(packet);
+			if (sent + batch && bytes + len > max_bytes) break;
+			bytes += len;
+			iovs[batch][0].iov_base = &packet->vnet;
+			iovs[batch][0].iov_len = sizeof(vnet_hdr_t);
+			iovs[batch][1].iov_base = packet->data;
+			iovs[batch][1].iov_len = packet->len;
+			memset(&msgs[batch].msg_hdr, 0, sizeof(msgs[batch].msg_hdr));
+			msgs[batch].msg_hdr.msg_iov = vnet ? iovs[batch] : &iovs[batch][1];
+			msgs[batch].msg_hdr.msg_iovlen = vnet ? 2 : 1;
+			++batch;
+		}
+		if (!batch) break;
+		int done = sendmmsg(sock, msgs, batch, 0);
+		if (done > 0 && mirror) mirror_sent(*mirror, msgs, done);
+		if (done < 0){
+			if (errno == EAGAIN || errno == ENOBUFS) break;
+			fprintf(stderr, "Send failed: %s\n", strerror(errno));
+			// Drop the frame rather than retry it forever
+			done = 1;
+			msgs[0].msg_len = queue.front()->len;
+		}
+		for (int i=0; i<done; ++i){
+			packet_t *packet = queue.front();
+			// The count may or may not take in a virtio-net header
+			if ((int)msgs[i].msg_len < packet->len){
+				fprintf(stderr, "Not all bytes written: %u,  %i\n", 
+						msgs[i].msg_len, packet->len);
+			}
+			sent_bytes += gso_wire_len(packet);
+			queue.pop_front();
+			packet_unref(packet);
+		}
+		sent += done;
+		if (done < batch) break;
+	}
+	return sent;
+}
+
+
+/* transmit() for a TAP device, which takes one frame per write, after its
+ * virtio-net header.
+ */
+int tap_transmit(int fd, queue_t &queue, int max_packets, long max_bytes,
+				 mirror_t *mirror, long &sent_bytes){
+	int sent = 0;
+	sent_bytes = 0;
+	while (sent < max_packets && !queue.empty()){
+		packet_t *packet = queue.front();
+		long len = gso_wire_len(packet);
+		if (sent && sent_bytes + len > max_bytes) break;
+		iovec iov[2] = {{&packet->vnet, sizeof(vnet_hdr_t)}, 
+						{packet->data, (size_t)packet->len}};
+		if (writev(fd, iov, 2) < 0){
+			if (errno == EAGAIN || errno == ENOBUFS) break;
+			// Drop the frame rather than retry it forever
+			fprintf(stderr, "Send failed: %s\n", strerror(errno));
+		} else if (mirror){
+			mmsghdr copy;
+			memset(&copy, 0, sizeof(copy));
+			copy.msg_hdr.msg_iov = mirror->vnet ? iov : &iov[1];
+			copy.msg_hdr.msg_iovlen = mirror->vnet ? 2 : 1;
+			mirror_sent(*mirror, &copy, 1);
+		}
+		sent_bytes += len;
+		queue.pop_front();
+		packet_unref(packet);
+		++sent;
+	}
+	return sent;
+}
+
+
+bool slot_is_open(const direction_t &d, uint64_t now){
+	return !d.config->slot_max || now >= d.slot.opens;
+}
+
+
+void slot_close(direction_t &d, uint64_t now){
+	d.slot.opens = now + slot_interval(d);
+}
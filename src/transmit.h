@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+
+#include "queue.h"
+#include "mirror.h"
+
+// Most frames handed to the kernel in one sendmmsg() call
+static const int TX_BATCH = 64;
+
+/* Departures are gated into slots, as netem's slot option: when a slot
+ * opens, whatever is queued (up to the slot's budget) goes out as one batch,
+ * and the next slot opens a random interval later.
+ */
+struct slot_t{
+	uint64_t opens;
+};
+
+struct direction_t;
+
+int transmit(int sock, bool vnet, queue_t &queue, int max_packets, long max_bytes,
+			 mirror_t *mirror, long &sent_bytes);
+int tap_transmit(int fd, queue_t &queue, int max_packets, long max_bytes,
+				 mirror_t *mirror, long &sent_bytes);
+bool slot_is_open(const direction_t &d, uint64_t now);
+void slot_close(direction_t &d, uint64_t now);
@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/if_packet.h>
+
+#include <new>
+#include <algorithm>
+
+#include "uring.h"
+#include "bridge.h"
+#include "memory.h"
+#include "transmit.h"
+#include "gso.h"
+#include "direction.h"
+
+// user_data of a send is this with its slot in 'sends'; anything else is a
+// source's place in 'sources'
+static const uint64_t SEND_TAG = 1ull << 62;
+
+// The only group of buffers each ring has
+static const int BUF_GROUP = 0;
+
+static const size_t CONTROL_LEN = CMSG_SPACE(sizeof(tpacket_auxdata));
+
+
+static int enter(uring_t &u, unsigned submit, unsigned wait, unsigned flags){
+	return syscall(__NR_io_uring_enter, u.fd, submit, wait, flags, NULL, 0);
+}
+
+
+static void *map_ring(int fd, size_t bytes, off_t offset){
+	void *ring = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, fd, offset);
+	return (ring == MAP_FAILED) ? NULL : ring;
+}
+
+
+// Give 'packet' to the kernel to receive into, as buffer 'id'
+static void post_buffer(uring_t &u, packet_t *packet, unsigned short id){
+	u.buffers[id] = packet;
+	// Entries overlay the header, which bufs[] doesn't in C++
+	io_uring_buf *bufs = (io_uring_buf *)u.buf_ring;
+	io_uring_buf &buf = bufs[u.buf_tail & (URING_BUFFERS - 1)];
+	buf.addr = (uint64_t)packet->data;
+	// Room to put back a VLAN tag the kernel took out
+	buf.len = u.buffer_size - VLAN_TAG_LEN;
+	buf.bid = id;
+	++u.buf_tail;
+}
+
+
+static bool fail(uring_t *u, const char *what){
+	fprintf(stderr, "Warning: No io_uring (%s: %s), using epoll\n", what,
+			strerror(errno));
+	if (u->fd >= 0) close(u->fd);
+	return false;
+}
+
+
+static bool setup(uring_t &u, bool sqpoll, int node){
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	if (sqpoll) params.flags |= IORING_SETUP_SQPOLL;
+	u.sqpoll = sqpoll;
+	u.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (u.fd < 0) return fail(&u, "setup");
+
+	size_t sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single) sq_bytes = cq_bytes = std::max(sq_bytes, cq_bytes);
+	char *sq = (char *)map_ring(u.fd, sq_bytes, IORING_OFF_SQ_RING);
+	char *cq = single ? sq : (char *)map_ring(u.fd, cq_bytes, IORING_OFF_CQ_RING);
+	u.sqes = (io_uring_sqe *)map_ring(u.fd, params.sq_entries * sizeof(io_uring_sqe),
+									  IORING_OFF_SQES);
+	if (!sq || !cq || !u.sqes) return fail(&u, "mmap");
+	u.sq_head = (unsigned *)(sq + params.sq_off.head);
+	u.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	u.sq_flags = (unsigned *)(sq + params.sq_off.flags);
+	u.sq_array = (unsigned *)(sq + params.sq_off.array);
+	u.sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	u.sq_entries = params.sq_entries;
+	u.sq_next = u.sq_submitted = *u.sq_tail;
+	u.cq_head = (unsigned *)(cq + params.cq_off.head);
+	u.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	u.cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	u.cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	u.buf_ring = (io_uring_buf_ring *)memory_alloc(
+		URING_BUFFERS * sizeof(io_uring_buf), node);
+	io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)u.buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = BUF_GROUP;
+	if (syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+		return fail(&u, "buffer ring");
+	}
+	u.buf_tail = 0;
+	for (int id=0; id<URING_BUFFERS; ++id){
+		post_buffer(u, packet_alloc(u.buffer_size), id);
+	}
+	__atomic_store_n(&u.buf_ring->tail, u.buf_tail, __ATOMIC_RELEASE);
+
+	// The kernel fills in the auxdata that says what VLAN tag it took out
+	memset(&u.recv_msg, 0, sizeof(u.recv_msg));
+	u.recv_msg.msg_controllen = CONTROL_LEN;
+	u.free_sends.reserve(URING_SENDS);
+	for (int s=URING_SENDS-1; s>=0; --s) u.free_sends.push_back(s);
+	u.free_chains.reserve(URING_SENDS);
+	for (int c=URING_SENDS-1; c>=0; --c) u.free_chains.push_back(c);
+	u.mirror = NULL;
+	u.n_copies = 0;
+	return true;
+}
+
+
+/* The size of the buffers a ring receives frames of 'packet_size' into:
+ * each starts with the kernel's io_uring_recvmsg_out and control messages,
+ * and any virtio-net header.
+ */
+int uring_buffer_size(int packet_size, bool vnet){
+	return packet_size + sizeof(io_uring_recvmsg_out) + CONTROL_LEN 
+		+ (vnet ? sizeof(vnet_hdr_t) : 0);
+}
+
+
+/* A ring for the calling worker, its memory on NUMA node 'node' where it
+ * can be, receiving frames of up to 'packet_size'.  Returns NULL if the
+ * kernel can't give one, or lacks the parts needed, after warning.
+ */
+uring_t *uring_open(bool sqpoll, int node, int packet_size, bool vnet){
+	uring_t *u = new (memory_alloc(sizeof(uring_t), node)) uring_t();
+	u->fd = -1;
+	u->buffer_size = uring_buffer_size(packet_size, vnet);
+	u->vnet = vnet;
+	if (!setup(*u, sqpoll, node)) return NULL;
+	return u;
+}
+
+
+// The next free submission entry, or NULL if the queue is full
+static io_uring_sqe *next_sqe(uring_t &u){
+	if (u.sq_next - __atomic_load_n(u.sq_head, __ATOMIC_ACQUIRE) == u.sq_entries){
+		return NULL;
+	}
+	unsigned index = u.sq_next++ & u.sq_mask;
+	u.sq_array[index] = index;
+	io_uring_sqe *sqe = &u.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+
+// Hand the kernel what's been queued, waiting for a completion if 'block'
+static void submit(uring_t &u, bool block){
+	__atomic_store_n(u.sq_tail, u.sq_next, __ATOMIC_RELEASE);
+	unsigned count = u.sq_next - u.sq_submitted;
+	u.sq_submitted = u.sq_next;
+	unsigned flags = block ? IORING_ENTER_GETEVENTS : 0;
+	if (u.sqpoll){
+		// The kernel thread takes them itself, unless it has gone to sleep
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(u.sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP){
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		}
+		count = 0;
+	}
+	if (count || flags) enter(u, count, block ? 1 : 0, flags);
+}
+
+
+static void start(uring_t &u, size_t source){
+	const uring_source_t &src = u.sources[source];
+	io_uring_sqe *sqe;
+	while (!(sqe = next_sqe(u))) submit(u, false);
+	sqe->fd = src.fd;
+	sqe->user_data = source;
+	if (src.recv){
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->addr = (uint64_t)&u.recv_msg;
+		sqe->len = 1;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		// payloadlen is then the whole frame's length, however much fit
+		sqe->msg_flags = MSG_TRUNC;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BUF_GROUP;
+	} else {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN;
+		sqe->len = IORING_POLL_ADD_MULTI;
+	}
+}
+
+
+// Report 'fd' readable as 'key', for as long as the ring lasts
+void uring_poll(uring_t &u, int fd, uint64_t key){
+	uring_source_t src = {key, fd, false};
+	u.sources.push_back(src);
+	start(u, u.sources.size() - 1);
+}
+
+
+// Report each frame read on 'sock' as 'key'
+void uring_recv(uring_t &u, int sock, uint64_t key){
+	uring_source_t src = {key, sock, true};
+	u.sources.push_back(src);
+	start(u, u.sources.size() - 1);
+}
+
+
+/* transmit() through the ring: queue sends for frames from the front of
+ * the direction's queue, linked so they go out in order, and count them in
+ * 'in_flight' until they're done.  Frames count as sent once queued, until
+ * they're put back; the mirror is sent its copies once they're done.
+ */
+int uring_transmit(uring_t &u, int sock, int &in_flight, direction_t &d,
+				   int max_packets, long max_bytes, mirror_t *mirror,
+				   long &sent_bytes){
+	queue_t &queue = d.queue;
+	int sent = 0;
+	sent_bytes = 0;
+	io_uring_sqe *last = NULL;
+	int chain = -1;
+	while (sent < max_packets && !queue.empty() && !u.free_sends.empty()){
+		packet_t *packet = queue.front();
+		long len = gso_wire_len(packet);
+		if (sent && sent_bytes + len > max_bytes) break;
+		io_uring_sqe *sqe = next_sqe(u);
+		if (!sqe) break;
+		int slot = u.free_sends.back();
+		u.free_sends.pop_back();
+		if (chain < 0){
+			// There are never more chains than sends
+			chain = u.free_chains.back();
+			u.free_chains.pop_back();
+			uring_chain_t c = {&d, mirror, 0, 0};
+			u.chains[chain] = c;
+		}
+		++u.chains[chain].pending;
+		uring_send_t &send = u.sends[slot];
+		send.packet = packet;
+		send.in_flight = &in_flight;
+		send.chain = chain;
+		send.iov[0].iov_base = &packet->vnet;
+		send.iov[0].iov_len = sizeof(vnet_hdr_t);
+		send.iov[1].iov_base = packet->data;
+		send.iov[1].iov_len = packet->len;
+		memset(&send.msg, 0, sizeof(send.msg));
+		send.msg.msg_iov = u.vnet ? send.iov : &send.iov[1];
+		send.msg.msg_iovlen = u.vnet ? 2 : 1;
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = sock;
+		sqe->addr = (uint64_t)&send.msg;
+		sqe->len = 1;
+		sqe->user_data = SEND_TAG | slot;
+		if (last) last->flags |= IOSQE_IO_LINK;
+		last = sqe;
+		queue.pop_front();
+		++in_flight;
+		sent_bytes += len;
+		++sent;
+	}
+	return sent;
+}
+
+
+static void send_copies(uring_t &u){
+	if (!u.n_copies) return;
+	mirror_sent(*u.mirror, u.copies, u.n_copies);
+	for (int i=0; i<u.n_copies; ++i) packet_unref(u.copied[i]);
+	u.n_copies = 0;
+}
+
+
+// Have a copy of a sent frame go to 'mirror' with the others sent
+static void copy_sent(uring_t &u, mirror_t *mirror, const uring_send_t &send){
+	if (u.n_copies == URING_EVENTS || (u.n_copies && mirror != u.mirror)){
+		send_copies(u);
+	}
+	u.mirror = mirror;
+	int i = u.n_copies++;
+	u.copy_iovs[i][0] = send.iov[0];
+	u.copy_iovs[i][1] = send.iov[1];
+	memset(&u.copies[i], 0, sizeof(u.copies[i]));
+	u.copies[i].msg_hdr.msg_iov = u.vnet ? u.copy_iovs[i] : &u.copy_iovs[i][1];
+	u.copies[i].msg_hdr.msg_iovlen = u.vnet ? 2 : 1;
+	u.copied[i] = packet_ref(send.packet);
+}
+
+
+static void send_done(uring_t &u, int slot, int res){
+	uring_send_t &send = u.sends[slot];
+	packet_t *packet = send.packet;
+	uring_chain_t &chain = u.chains[send.chain];
+	// A failed send cancels those linked after it.  Like transmit(), frames
+	// the device had no room for are sent again later.
+	if (res == -ENOBUFS || res == -EAGAIN || res == -ECANCELED){
+		direction_t &d = *chain.d;
+		d.queue.insert(d.queue.begin() + chain.requeued++, packet);
+		--d.stats.sent;
+		d.stats.sent_bytes -= gso_wire_len(packet);
+	} else {
+		if (res < 0){
+			fprintf(stderr, "Send failed: %s\n", strerror(-res));
+		} else if (res < packet->len){
+			fprintf(stderr, "Not all bytes written: %i,  %i\n", res, packet->len);
+		}
+		if (res >= 0 && chain.mirror) copy_sent(u, chain.mirror, send);
+		packet_unref(packet);
+	}
+	if (--chain.pending == 0) u.free_chains.push_back(send.chain);
+	--*send.in_flight;
+	u.free_sends.push_back(slot);
+}
+
+
+// Take the frame the kernel received into buffer 'id', and post another
+static packet_t *received(uring_t &u, unsigned short id){
+	packet_t *packet = u.buffers[id];
+	post_buffer(u, packet_alloc(u.buffer_size), id);
+	__atomic_store_n(&u.buf_ring->tail, u.buf_tail, __ATOMIC_RELEASE);
+
+	// The buffer holds a header, the control messages and then the frame,
+	// after its virtio-net header if there is one
+	char *data = packet->data;
+	io_uring_recvmsg_out out;
+	memcpy(&out, data, sizeof(out));
+	size_t offset = sizeof(out) + u.recv_msg.msg_namelen + CONTROL_LEN;
+	int len = std::min((int)out.payloadlen, u.buffer_size - VLAN_TAG_LEN - (int)offset);
+	char control[CONTROL_LEN];
+	memcpy(control, data + offset - CONTROL_LEN, CONTROL_LEN);
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = out.controllen;
+	int whole = out.payloadlen;
+	if (u.vnet){
+		len = std::max(len - (int)sizeof(vnet_hdr_t), 0);
+		whole = std::max(whole - (int)sizeof(vnet_hdr_t), 0);
+		memcpy(&packet->vnet, data + offset, sizeof(vnet_hdr_t));
+		offset += sizeof(vnet_hdr_t);
+	}
+	if (whole > len) warn_cut(len, whole);
+	memmove(data, data + offset, len);
+	packet->len = restore_vlan(data, len, msg);
+	if (u.vnet) gso_received(packet, packet->len - len);
+	return packet;
+}
+
+
+/* Submit what's queued, wait for something to complete if 'block', and
+ * report what has, up to 'max' events.  Sends are finished off here.
+ */
+int uring_wait(uring_t &u, bool block, uring_event_t *events, int max){
+	submit(u, block);
+	int count = 0;
+	unsigned head = *u.cq_head;
+	unsigned tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail && count < max){
+		io_uring_cqe cqe = u.cqes[head & u.cq_mask];
+		++head;
+		uring_event_t &event = events[count++];
+		event.packet = NULL;
+		if (cqe.user_data & SEND_TAG){
+			send_done(u, cqe.user_data & ~SEND_TAG, cqe.res);
+			event.key = URING_SENT;
+			continue;
+		}
+		const uring_source_t &src = u.sources[cqe.user_data];
+		event.key = src.key;
+		// Out of buffers, say, or the kernel tired of it
+		if (!(cqe.flags & IORING_CQE_F_MORE)) start(u, cqe.user_data);
+		if (cqe.res == -ENOBUFS) continue;
+		if (cqe.res < 0){
+			fprintf(stderr, "Read failed: %s from %i\n", strerror(-cqe.res), src.fd);
+			abort();
+		}
+		if (src.recv && (cqe.flags & IORING_CQE_F_BUFFER)){
+			event.packet = received(u, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+	}
+	__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+	send_copies(u);
+	return count;
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include <vector>
+
+#include "queue.h"
+#include "mirror.h"
+
+// Key of the event for a finished send
+static const uint64_t URING_SENT = ~0ull - 2;
+
+// Submission queue size, frames posted for the kernel to receive into, and
+// sends in flight at once
+static const unsigned URING_ENTRIES = 2048;
+static const int URING_BUFFERS = 1024;
+static const int URING_SENDS = 1024;
+
+// Most completions handled in one pass
+static const int URING_EVENTS = 256;
+
+struct uring_event_t{
+	uint64_t key;
+	// The frame received, or NULL for a poll or a send
+	packet_t *packet;
+};
+
+// A multishot request, made again whenever the kernel ends it
+struct uring_source_t{
+	uint64_t key;
+	int fd;
+	bool recv;
+};
+
+struct direction_t;
+
+/* Sends queued together from one direction, linked so they go out in
+ * order.  When one fails for want of room, it and those cancelled after it
+ * go back to the front of the direction's queue, in order, to be sent
+ * again.
+ */
+struct uring_chain_t{
+	direction_t *d;
+	mirror_t *mirror;
+	// Sends not yet done, and frames put back so far
+	int pending;
+	int requeued;
+};
+
+struct uring_send_t{
+	msghdr msg;
+	// The virtio-net header, if the ring's sockets take one, and the frame
+	iovec iov[2];
+	packet_t *packet;
+	int *in_flight;
+	int chain;
+};
+
+/* An io_uring, set up by hand with the raw system calls.  Sockets are read
+ * with multishot receives into packet buffers posted on a provided buffer
+ * ring, so a frame is handed over without a system call of its own.  Sends
+ * are queued up and submitted together with the wait for completions; with
+ * SQPOLL, a kernel thread submits them and a spinning worker makes no
+ * system calls at all.
+ */
+struct uring_t{
+	int fd;
+	bool sqpoll;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_flags;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	io_uring_sqe *sqes;
+	// Entries filled in but not yet handed to the kernel end here
+	unsigned sq_next;
+	unsigned sq_submitted;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	io_uring_cqe *cqes;
+	// buffers[id] is the packet posted with buffer ID 'id', of 'buffer_size'
+	io_uring_buf_ring *buf_ring;
+	int buffer_size;
+	unsigned short buf_tail;
+	packet_t *buffers[URING_BUFFERS];
+	msghdr recv_msg;
+	// Frames come and go with a virtio-net header
+	bool vnet;
+	std::vector<uring_source_t> sources;
+	uring_send_t sends[URING_SENDS];
+	std::vector<int> free_sends;
+	// Each chain has at least one send
+	uring_chain_t chains[URING_SENDS];
+	std::vector<int> free_chains;
+	// Copies of sent frames for the mirror, whose frames are held until
+	// they're sent in one go
+	mirror_t *mirror;
+	mmsghdr copies[URING_EVENTS];
+	iovec copy_iovs[URING_EVENTS][2];
+	packet_t *copied[URING_EVENTS];
+	int n_copies;
+};
+
+int uring_buffer_size(int packet_size, bool vnet);
+uring_t *uring_open(bool sqpoll, int node, int packet_size, bool vnet);
+void uring_poll(uring_t &u, int fd, uint64_t key);
+void uring_recv(uring_t &u, int sock, uint64_t key);
+int uring_transmit(uring_t &u, int sock, int &in_flight, direction_t &d,
+				   int max_packets, long max_bytes, mirror_t *mirror,
+				   long &sent_bytes);
+int uring_wait(uring_t &u, bool block, uring_event_t *events, int max);
@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+
+/* The virtio-net header TAP devices, and packet sockets with
+ * PACKET_VNET_HDR, put before each frame.  It's struct virtio_net_hdr,
+ * which linux/virtio_net.h can't give C++ code.
+ */
+struct vnet_hdr_t{
+	uint8_t flags;
+	uint8_t gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+};
+
+// The sender is to fill in the checksum at csum_start + csum_offset
+static const uint8_t VNET_NEEDS_CSUM = 1;
+// The checksums are known to be good, and needn't be checked
+static const uint8_t VNET_DATA_VALID = 2;
+
+static const uint8_t VNET_GSO_NONE = 0;
+static const uint8_t VNET_GSO_TCPV4 = 1;
+static const uint8_t VNET_GSO_TCPV6 = 4;
+static const uint8_t VNET_GSO_UDP_L4 = 5;
+// Or'd with the type when the segments carry ECN
+static const uint8_t VNET_GSO_ECN = 0x80;